@@ -21,6 +21,15 @@
 /** Zigbee network identifier. */
 #define ZIGBEE_NETWORK 0X04
 
+/** First byte of the frames with the binary header (version 1): marker, network identifiers and purpose, followed by the binary payload. Frames with the hexadecimal header start with the network identifiers, so their first byte never takes this value. */
+#define FRAME_BINARY_HEADER_V1 0XA1
+
+/** Size in bytes of the binary header (version 1). */
+#define FRAME_BINARY_HEADER_SIZE 3
+
+/** Flag of the purpose byte indicating that the data is fragmented and more frames follow. */
+#define FRAME_MORE_FRAGMENTS 0X80
+
 
 /****************************************************************************
 *                            Enumerations                                   *
@@ -38,4 +47,23 @@ enum FramePurpouse{
   RTC_TIME          /** RTC */
 };
 
+/** Enumeration of the frame header versions. */
+enum FrameHeaderVersion{
+  FRAME_HEADER_HEX = 0,   /** Network and purpose as hexadecimal characters, followed by the hexadecimal payload */
+  FRAME_HEADER_BINARY_V1  /** Binary header (version 1) followed by the binary payload */
+};
+
+
+/****************************************************************************
+*                             Structures                                    *
+****************************************************************************/
+
+/** Header of a received frame, decoded once on reception. */
+struct frame_header {
+  uint8_t version; /// Version of the header (FrameHeaderVersion)
+  uint8_t network; /// Destination network identifiers
+  uint8_t purpose; /// Purpose of the frame (FramePurpouse) without the fragmentation flag
+  bool more_fragments; /// True if the data is fragmented and more frames follow
+};
+
 #endif
@@ -177,51 +177,204 @@ void Lorawan::init_lorawan(){
       USB.println(lorawan_status, DEC);
     }
   #endif
+
+  // The session is opened again by the first operation.
+  session_on = false;
+  session_joined = false;
 }
 
 
-void Lorawan::lorawan_send(uint8_t port, uint8_t* data_send, uint16_t size_data){
+uint8_t Lorawan::open_session(){
+  unsigned long start_time = millis();
+
   ///////////////////////////////
   // 1. LoRaWAN module activation.
   ///////////////////////////////
 
-  // The LoRaWAN module is activated.
-  lorawan_status = LoRaWAN.ON(SOCKET_LORAWAN);
+  // The LoRaWAN module is activated, unless it was kept on by the previous operation.
+  if(!session_on){
+    lorawan_status = LoRaWAN.ON(SOCKET_LORAWAN);
 
-  #if DEBUG_LORAWAN == 1
-    if( lorawan_status == 0 ){
-      USB.println(F("1. LoRaWAN module activated."));     
-    }else{
-      USB.print(F("1. Error activating LoRaWAN module = ")); 
-      USB.println(lorawan_status, DEC);
+    #if DEBUG_LORAWAN == 1
+      if( lorawan_status == 0 ){
+        USB.println(F("1. LoRaWAN module activated."));     
+      }else{
+        USB.print(F("1. Error activating LoRaWAN module = ")); 
+        USB.println(lorawan_status, DEC);
+      }
+    #endif
+
+    if( lorawan_status != 0 ){
+      session_stats.setup_time += millis() - start_time;
+      return lorawan_status;
     }
-  #endif
+    session_on = true;
+    session_stats.power_cycles ++;
+  }
 
   ///////////////////////////////
   // 2. LoRaWAN network connection
   ///////////////////////////////
 
-  lorawan_status = LoRaWAN.joinABP();
+  // The network is joined only once per session, or again after the session has been lost.
+  lorawan_status = 0;
+  if(!session_joined){
+    lorawan_status = LoRaWAN.joinABP();
 
-  if( lorawan_status == 0 ) {
     #if DEBUG_LORAWAN == 1
-      USB.println(F("2. Connection to the LoRaWAN network correct."));   
-    #endif  
+      if( lorawan_status == 0 ){
+        USB.println(F("2. Connection to the LoRaWAN network correct."));   
+      }else{
+        USB.print(F("2. Failed joining to the LoRaWAN network = ")); 
+        USB.println(lorawan_status, DEC);
+      }
+    #endif
+
+    if( lorawan_status == 0 ){
+      session_joined = true;
+      session_stats.joins ++;
+    }
+  }
+
+  session_stats.setup_time += millis() - start_time;
+  return lorawan_status;
+}
+
+uint8_t Lorawan::send_uplink(uint8_t* data_send, uint16_t size_data, bool confirmed){
+  unsigned long start_time = millis();
+
+  if(confirmed){
+    lorawan_status = LoRaWAN.sendConfirmed( PORT, data_send, size_data);
+  }else{
+    lorawan_status = LoRaWAN.sendUnconfirmed( PORT, data_send, size_data);
+  }
+
+  session_stats.transfer_time += millis() - start_time;
+  session_stats.transfers ++;
+
+  // Error messages:
+  /*
+   * '6' : Module hasn't joined a network
+   * '5' : Sending error
+   * '4' : Error with data length   
+   * '2' : Module didn't response
+   * '1' : Module communication error   
+   */
+  if( lorawan_status == 6 ){
+    // The session has been lost, so the network is joined again in the next operation.
+    session_joined = false;
+  }else if( lorawan_status == 1 || lorawan_status == 2 ){
+    // The module does not answer, so it is turned off and on again in the next operation.
+    close_session();
+  }
+  return lorawan_status;
+}
+
+void Lorawan::close_session(){
+  unsigned long start_time = millis();
+
+  // The LoRaWAN module is turned off.
+  if(session_on){
+    uint8_t status = LoRaWAN.OFF(SOCKET_LORAWAN);
+
+    #if DEBUG_LORAWAN == 1
+      if( status == 0 ){
+        USB.println(F("4. LoRaWAN module turned off."));     
+      }else{
+        USB.print(F("4. Error turned off LoRaWAN module = ")); 
+        USB.println(status, DEC);
+        USB.println();
+      }
+    #endif
+  }
+  session_on = false;
+  session_joined = false;
+
+  session_stats.setup_time += millis() - start_time;
+}
+
+struct lorawan_session_stats Lorawan::get_session_stats(){
+  return session_stats;
+}
+
+bool Lorawan::poll_due(){
+  return (millis() - last_poll_time) >= poll_stats.interval;
+}
+
+void Lorawan::poll_now(){
+  poll_stats.interval = 0;
+}
+
+struct lorawan_poll_stats Lorawan::get_poll_stats(){
+  return poll_stats;
+}
+
+void Lorawan::set_fragmentation_timeout(unsigned long timeout){
+  fragmentation_timeout = timeout;
+}
+
+struct frame_header Lorawan::get_frame_header(){
+  return header;
+}
+
+void Lorawan::decode_frame_header(){
+  uint8_t purpose;
+
+  // The first byte is the marker of the binary header or, in the hexadecimal header, the network identifiers.
+  if(strlen(LoRaWAN._data) >= 2*FRAME_BINARY_HEADER_SIZE && conversions_object.char_to_uint8t(LoRaWAN._data[0],LoRaWAN._data[1]) == FRAME_BINARY_HEADER_V1){
+    header.version = FRAME_HEADER_BINARY_V1;
+    header.network = conversions_object.char_to_uint8t(LoRaWAN._data[2],LoRaWAN._data[3]);
+    purpose = conversions_object.char_to_uint8t(LoRaWAN._data[4],LoRaWAN._data[5]);
+  }else{
+    header.version = FRAME_HEADER_HEX;
+    header.network = conversions_object.char_to_uint8t(LoRaWAN._data[0],LoRaWAN._data[1]);
+    purpose = conversions_object.char_to_uint8t(LoRaWAN._data[2],LoRaWAN._data[3]);
+  }
+  header.purpose = purpose & ~FRAME_MORE_FRAGMENTS;
+  header.more_fragments = purpose & FRAME_MORE_FRAGMENTS;
+}
+
+void Lorawan::schedule_poll(bool received, bool pending){
+  unsigned long now = millis();
+
+  poll_stats.polls ++;
+  if(received){
+    // The time since the previous poll bounds how long the downlink waited in the network server.
+    poll_stats.hits ++;
+    poll_stats.latency_sum += now - last_poll_time;
+    if(now - last_poll_time > poll_stats.latency_max){
+      poll_stats.latency_max = now - last_poll_time;
+    }
+  }
+  last_poll_time = now;
+
+  if(received && pending){
+    // More frames are queued in the gateway, so they are requested straight away.
+    poll_stats.interval = LORAWAN_POLL_PENDING_INTERVAL;
+    poll_stats.pending_polls ++;
+  }else if(received || poll_stats.interval < LORAWAN_POLL_MIN_INTERVAL){
+    poll_stats.interval = LORAWAN_POLL_MIN_INTERVAL;
+  }else{
+    // Exponential backoff while the gateway has nothing to send.
+    poll_stats.interval *= 2;
+  }
+  if(poll_stats.interval > LORAWAN_POLL_MAX_INTERVAL){
+    poll_stats.interval = LORAWAN_POLL_MAX_INTERVAL;
+  }
+}
+
+void Lorawan::lorawan_send(uint8_t port, uint8_t* data_send, uint16_t size_data){
+  ///////////////////////////////
+  // 1-2. LoRaWAN session
+  ///////////////////////////////
+
+  if( open_session() == 0 ) {
 
     ///////////////////////////////
     // 3. Sending confirmed data through LoRaWAN
     ///////////////////////////////
   
-    lorawan_status = LoRaWAN.sendConfirmed( PORT, data_send, size_data);
-
-    // Error messages:
-    /*
-     * '6' : Module hasn't joined a network
-     * '5' : Sending error
-     * '4' : Error with data length   
-     * '2' : Module didn't response
-     * '1' : Module communication error   
-     */
+    send_uplink(data_send, size_data, true);
 
     #if DEBUG_LORAWAN == 1
       if( lorawan_status == 0 ){
@@ -234,116 +387,164 @@ void Lorawan::lorawan_send(uint8_t port, uint8_t* data_send, uint16_t size_data)
       } 
     #endif
   }
-  else 
-  {
-    #if DEBUG_LORAWAN == 1
-      USB.print(F("2. Failed joining to the LoRaWAN network = ")); 
-      USB.println(lorawan_status, DEC);
-    #endif
-  }
 
   ///////////////////////////////
   // 4. LoRaWAN module turn off
   ///////////////////////////////
 
-  // The LoRaWAN module is turned off.
-  lorawan_status = LoRaWAN.OFF(SOCKET_LORAWAN);
-
-  #if DEBUG_LORAWAN == 1
-    if( lorawan_status == 0 ){
-      USB.println(F("4. LoRaWAN module turned off."));     
-    }else{
-      USB.print(F("4. Error turned off LoRaWAN module = ")); 
-      USB.println(lorawan_status, DEC);
-      USB.println();
-    }
+  #if LORAWAN_KEEP_SESSION == 0
+    close_session();
   #endif
 }
 
 bool Lorawan::receive_lorawan(uint8_t* port_received, char* data_received, int* data_size_received, int* fragment_size){
+  enum lorawan_rx_state state;
+
   // Variable Inicialization.
-  lorawan_receiving = true;
-  *data_size_received = 0;
-  *fragment_size = 0;
-  status_lorawan_reception = false;
+  if(!lorawan_receiving){
+    *data_size_received = 0;
+    *fragment_size = 0;
+  }
 
   // The LoRaWAN data reception function is called as long as it has not finished receiving all the data.
-  while(lorawan_receiving){
-    status_lorawan_reception = lorawan_reception();
-    // It is checked if the data has been fragmented through the flag defined in the frame. If so, it will be indicated that the reception is continued. Otherwise, the end of the reception will be indicated.
-    if((conversions_object.char_to_uint8t(LoRaWAN._data[2],LoRaWAN._data[3]) & 0x80 ) && status_lorawan_reception == true){
-      lorawan_receiving = true;
-      *fragment_size = strlen(LoRaWAN._data);
-    }else{
-      lorawan_receiving = false;
+  do{
+    // The next frame of the message is awaited until it has to be polled.
+    while(lorawan_receiving && !poll_due()){
+      delay(1);
     }
-    // The data received through LoRaWAN is updated.
-    memset((data_received + ((*data_size_received)*sizeof(char))), '0', (strlen(LoRaWAN._data)*sizeof(char)));
-    memcpy((data_received + ((*data_size_received)*sizeof(char))), LoRaWAN._data, (strlen(LoRaWAN._data)*sizeof(char)));
-    (*port_received) = LoRaWAN._port;
-    (*data_size_received) += strlen(LoRaWAN._data);
+    state = receive_lorawan_step(port_received, data_received, data_size_received, fragment_size, 0);
+  }while(state == LORAWAN_RX_RECEIVING);
 
-    // A timeout is established between fragmented data frames.
-    if((conversions_object.char_to_uint8t(LoRaWAN._data[2],LoRaWAN._data[3]) & 0x80 )){
-      delay(FRAGMENTATION_WAITING_TIME);   
-    }
+  return state == LORAWAN_RX_DONE;
+}
+
+enum lorawan_rx_state Lorawan::receive_lorawan_step(uint8_t* port_received, char* data_received, int* data_size_received, int* fragment_size, int buffer_size){
+  enum lorawan_rx_state state;
+  int size;
+
+  // Variable Inicialization when a new message starts.
+  if(!lorawan_receiving){
+    *data_size_received = 0;
+    *fragment_size = 0;
+  }
 
-    // The receive array is initialized to zero.
-    memset(LoRaWAN._data, '0', (strlen(LoRaWAN._data)*sizeof(char)));  
+  // The next frame is not polled if it may not fit in the rest of the buffer, and the message is abandoned.
+  if(buffer_size > 0 && buffer_size - *data_size_received < LORAWAN_FRAME_MAX){
+    #if DEBUG_LORAWAN == 1
+      USB.println(F("Message longer than the buffer"));
+    #endif
+    lorawan_receiving = false;
+    return LORAWAN_RX_FAILED;
+  }
+
+  // The frame received is appended to the previous ones.
+  state = receive_fragment_step(port_received, data_received + *data_size_received, &size);
+  if(size > 0){
+    if(header.more_fragments){
+      *fragment_size = size;
+    }
+    (*data_size_received) += size;
   }
-  return status_lorawan_reception;
+  return state;
 }
 
+enum lorawan_rx_state Lorawan::receive_fragment_step(uint8_t* port_received, char* fragment, int* fragment_size){
+  *fragment_size = 0;
 
-bool Lorawan::lorawan_reception(){
-  ///////////////////////////////
-  // 1. LoRaWAN module activation.
-  ///////////////////////////////
+  // A new message is only polled when the polling interval has elapsed.
+  if(!lorawan_receiving){
+    if(!poll_due()){
+      return LORAWAN_RX_IDLE;
+    }
+    lorawan_receiving = true;
+    frames_received = 0;
+    last_frame_time = millis();
+  }else if(!poll_due()){
+    // The next frame of the message is not polled again before the retry interval.
+    return LORAWAN_RX_RECEIVING;
+  }
 
-  // The LoRaWAN module is activated.
-  lorawan_status = LoRaWAN.ON(SOCKET_LORAWAN);
+  status_lorawan_reception = lorawan_reception();
+  if(status_lorawan_reception == true){
+    // It is checked if the data has been fragmented through the flag defined in the frame. If so, the next frame is requested in the next step. Otherwise, the end of the reception will be indicated.
+    lorawan_receiving = header.more_fragments;
 
-  #if DEBUG_LORAWAN == 1
-    if( lorawan_status == 0 ){
-      USB.println(F("1. LoRaWAN module activated."));     
+    // The data received through LoRaWAN is updated. A frame longer than the buffer can only arrive if the network raised the data rate, and it is cut.
+    if(header.version == FRAME_HEADER_HEX){
+      // The whole frame is kept as received.
+      *fragment_size = strlen(LoRaWAN._data);
+      if(*fragment_size > LORAWAN_FRAME_MAX){
+        *fragment_size = LORAWAN_FRAME_MAX;
+      }
+      memcpy(fragment, LoRaWAN._data, (*fragment_size)*sizeof(char));
     }else{
-      USB.print(F("1. Error activating LoRaWAN module = ")); 
-      USB.println(lorawan_status, DEC);
+      // Only the payload is kept, converted from the hexadecimal characters to bytes.
+      *fragment_size = strlen(LoRaWAN._data)/2 - FRAME_BINARY_HEADER_SIZE;
+      if(*fragment_size > LORAWAN_FRAME_MAX){
+        *fragment_size = LORAWAN_FRAME_MAX;
+      }
+      for(int i=0; i<*fragment_size; i++){
+        fragment[i] = conversions_object.char_to_uint8t(LoRaWAN._data[2*(FRAME_BINARY_HEADER_SIZE+i)],LoRaWAN._data[2*(FRAME_BINARY_HEADER_SIZE+i)+1]);
+      }
     }
-  #endif
+    (*port_received) = LoRaWAN._port;
+    frames_received ++;
+    last_frame_time = millis();
+    fragment_retry_interval = LORAWAN_FRAGMENT_RETRY_INTERVAL;
+  }else{
+    // The next frame of a fragmented message may not be queued in the gateway yet, so it is polled again until the timeout elapses. Only a poll without data, a sending error (5, for example no free channel under the duty cycle) or a lost network (6) can succeed later.
+    bool transient = (lorawan_status == 0 || lorawan_status == 5 || lorawan_status == 6);
+    lorawan_receiving = (frames_received > 0) && transient && (millis() - last_frame_time < fragmentation_timeout);
+    if(lorawan_receiving){
+      // The polls are spaced with exponential backoff, so a frame that is late does not keep the radio busy.
+      poll_stats.interval = fragment_retry_interval;
+      if(fragment_retry_interval < LORAWAN_POLL_MIN_INTERVAL){
+        fragment_retry_interval *= 2;
+      }
+    }else{
+      fragment_retry_interval = LORAWAN_FRAGMENT_RETRY_INTERVAL;
+    }
+  }
+
+  // The receive array is initialized to zero.
+  memset(LoRaWAN._data, '0', (strlen(LoRaWAN._data)*sizeof(char)));  
 
+  if(lorawan_receiving){
+    return LORAWAN_RX_RECEIVING;
+  }else if(status_lorawan_reception == true){
+    return LORAWAN_RX_DONE;
+  }else if(frames_received > 0){
+    return LORAWAN_RX_FAILED;
+  }
+  return LORAWAN_RX_IDLE;
+}
+
+
+bool Lorawan::lorawan_reception(){
   ///////////////////////////////
-  // 2. LoRaWAN network connection
+  // 1-2. LoRaWAN session
   ///////////////////////////////
 
-  lorawan_status = LoRaWAN.joinABP();
+  LoRaWAN._dataReceived = false;
 
-  if( lorawan_status == 0 ) {
-    #if DEBUG_LORAWAN == 1
-      USB.println(F("2. Connection to the LoRaWAN network correct."));   
-    #endif  
+  if( open_session() == 0 ) {
 
     ///////////////////////////////
-    // 3. Sending confirmed data through LoRaWAN
+    // 3. Sending poll data through LoRaWAN
     ///////////////////////////////
 
-    // Data sent to the LoRaWAN gateway for data reception.
-    uint8_t data[] = {0x00};
+    // Data sent to the LoRaWAN gateway for data reception. It announces whether the binary frame header is supported.
+    #if LORAWAN_BINARY_HEADER == 1
+      uint8_t data[] = {FRAME_BINARY_HEADER_V1};
+    #else
+      uint8_t data[] = {0x00};
+    #endif
   
-    lorawan_status = LoRaWAN.sendConfirmed( PORT, data, sizeof(data));
-
-    // Error messages:
-    /*
-     * '6' : Module hasn't joined a network
-     * '5' : Sending error
-     * '4' : Error with data length   
-     * '2' : Module didn't response
-     * '1' : Module communication error   
-     */
+    send_uplink(data, sizeof(data), LORAWAN_POLL_CONFIRMED);
 
       if( lorawan_status == 0 ){
         #if DEBUG_LORAWAN == 1
-          USB.println(F("3. Send confirmed through LoRaWAN correct.")); 
+          USB.println(F("3. Send poll through LoRaWAN correct.")); 
         #endif
         
         if (LoRaWAN._dataReceived == true){
@@ -365,42 +566,36 @@ bool Lorawan::lorawan_reception(){
         #endif
       } 
   }
-  else 
-  {
-    #if DEBUG_LORAWAN == 1
-      USB.print(F("2. Failed joining to the LoRaWAN network = ")); 
-      USB.println(lorawan_status, DEC);
-    #endif
-  }
 
   ///////////////////////////////
   // 4. LoRaWAN module turn off
   ///////////////////////////////
 
-  // The LoRaWAN module is turned off.
-  lorawan_status = LoRaWAN.OFF(SOCKET_LORAWAN);
-
-  #if DEBUG_LORAWAN == 1
-    if( lorawan_status == 0 ){
-      USB.println(F("4. LoRaWAN module turned off."));     
-    }else{
-      USB.print(F("4. Error turned off LoRaWAN module = ")); 
-      USB.println(lorawan_status, DEC);
-      USB.println();
-    }
+  #if LORAWAN_KEEP_SESSION == 0
+    close_session();
   #endif
 
    ///////////////////////////////
-  // 5. Message Information Received
+  // 5. Next poll
+  ///////////////////////////////
+
+  // The header is decoded once per frame. Its flag of fragmented data indicates that more frames are pending in the gateway.
+  if(LoRaWAN._dataReceived == true){
+    decode_frame_header();
+  }
+  schedule_poll(LoRaWAN._dataReceived, LoRaWAN._dataReceived && header.more_fragments);
+
+  ///////////////////////////////
+  // 6. Message Information Received
   ///////////////////////////////
   if (LoRaWAN._dataReceived == true){
     #if DEBUG_LORAWAN == 1
-      USB.println(F("5. LoRaWAN frame received."));
+      USB.println(F("6. LoRaWAN frame received."));
     #endif
     return true;
   }else{
     #if DEBUG_LORAWAN == 1
-      USB.println(F("5. No LoRaWAN frames received."));
+      USB.println(F("6. No LoRaWAN frames received."));
     #endif
     return false;
   }
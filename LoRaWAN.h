@@ -19,6 +19,7 @@
 #include <WaspLoRaWAN.h>
 
 #include "Conversions.h"
+#include "Frame.h"
 
 /****************************************************************************
 *                             Define                                        *
@@ -42,11 +43,79 @@
 */
 #define DATA_RATE_LORAWAN 3
 
+/** Maximum payload (bytes) of the downlinks at the selected data rate. */
+#if DATA_RATE_LORAWAN < 3
+  #define LORAWAN_MAX_PAYLOAD 51
+#elif DATA_RATE_LORAWAN == 3
+  #define LORAWAN_MAX_PAYLOAD 115
+#else
+  #define LORAWAN_MAX_PAYLOAD 222
+#endif
+
+/** Size of the buffer of a received frame, which is kept in hexadecimal characters with the hexadecimal header. */
+#define LORAWAN_FRAME_MAX (2 * LORAWAN_MAX_PAYLOAD)
+
 /** LoRaWAN communication port. */
 #define PORT 3
 
-/** Waiting time between receiving fragmented data frames. */
-#define FRAGMENTATION_WAITING_TIME 5000
+/** Maximum time (ms) waiting for the next frame of a fragmented message. The gateway is polled again, with a growing interval, until the frame arrives or this time elapses since the last frame. */
+#define FRAGMENTATION_TIMEOUT 15000
+
+/** Defines whether the LoRaWAN module is kept on and joined between operations, joining again only after an error (1), or it is turned on, joined and turned off in each operation (0). */
+#define LORAWAN_KEEP_SESSION 1
+
+/** Interval (ms) between downlink polls after a poll that received data. Every miss doubles the interval up to LORAWAN_POLL_MAX_INTERVAL. */
+#define LORAWAN_POLL_MIN_INTERVAL 2000
+
+/** Maximum interval (ms) between downlink polls when no data is received. */
+#define LORAWAN_POLL_MAX_INTERVAL 60000
+
+/** Interval (ms) until the next downlink poll when the received frame indicates that more frames are pending. */
+#define LORAWAN_POLL_PENDING_INTERVAL 0
+
+/** Interval (ms) until the first poll again for the next frame of a fragmented message that was not in the gateway yet. Every further miss doubles it up to LORAWAN_POLL_MIN_INTERVAL. */
+#define LORAWAN_FRAGMENT_RETRY_INTERVAL 500
+
+/** Defines whether the uplinks that poll for downlink data are sent confirmed (1) or unconfirmed (0). Unconfirmed polls save the airtime of the acknowledgement. */
+#define LORAWAN_POLL_CONFIRMED 1
+
+/** Defines whether the polls announce to the gateway that the binary frame header is supported (1), by sending its marker instead of 0x00 (0). Frames with the hexadecimal header are received in both cases. */
+#define LORAWAN_BINARY_HEADER 1
+
+/****************************************************************************
+*                            Enumerations                                   *
+****************************************************************************/
+
+/** States returned by each step of the reception. */
+enum lorawan_rx_state {
+  LORAWAN_RX_IDLE,      /// No message has been received
+  LORAWAN_RX_RECEIVING, /// Fragments of a message are being received, so the next step polls again
+  LORAWAN_RX_DONE,      /// A whole message has been received
+  LORAWAN_RX_FAILED     /// The next fragment of a message has not arrived before the timeout, or the module can not poll for it
+};
+
+/****************************************************************************
+*                             Structures                                    *
+****************************************************************************/
+
+/** Time spent by the LoRaWAN connection. */
+struct lorawan_session_stats {
+  unsigned long setup_time; /// Time (ms) spent turning the module on and off and joining the network
+  unsigned long transfer_time; /// Time (ms) spent sending the uplinks and waiting for their downlinks
+  unsigned int power_cycles; /// Times that the module was turned on
+  unsigned int joins; /// Joins to the network
+  unsigned int transfers; /// Uplinks sent
+};
+
+/** Statistics of the downlink polling. */
+struct lorawan_poll_stats {
+  unsigned int polls; /// Uplinks sent to open a reception window
+  unsigned int hits; /// Polls that received a downlink
+  unsigned int pending_polls; /// Polls brought forward because the previous frame indicated more pending frames
+  unsigned long latency_sum; /// Sum of the time (ms) between the previous poll and each poll that received a downlink
+  unsigned long latency_max; /// Maximum time (ms) between the previous poll and a poll that received a downlink
+  unsigned long interval; /// Current interval (ms) until the next poll
+};
 
 class Lorawan{
   public:
@@ -101,20 +170,163 @@ class Lorawan{
     * Function used to receive data through LoRaWAN, where initially a message will be sent so that a downlink link can be established, so that it will be possible to know if data has been received.
     */
     bool receive_lorawan(uint8_t* port_recived, char* data_received, int* data_size_received, int* fragment_size);
+
+    /**
+    * \fn enum lorawan_rx_state receive_lorawan_step(uint8_t* port_received, char* data_received, int* data_size_received, int* fragment_size, int buffer_size)
+    * \param Data reception port.
+    * \param Pointer associated with the data received through LoRaWAN
+    * \param Pointer associated with the size of the data received through LoRaWAN
+    * \param Pointer associated with the size of the data fragment received in case there is fragmentation.
+    * \param Size of the buffer of the data, or 0 if it is not checked.
+    * \return State of the reception after this step.
+    * 
+    * Function that performs a single step of receive_lorawan: it sends one poll, if it is due or a fragmented message is being received, and returns. The same pointers must be passed while it returns LORAWAN_RX_RECEIVING. A message whose next frame may not fit in the buffer is abandoned with LORAWAN_RX_FAILED.
+    */
+    enum lorawan_rx_state receive_lorawan_step(uint8_t* port_received, char* data_received, int* data_size_received, int* fragment_size, int buffer_size);
+
+    /**
+    * \fn enum lorawan_rx_state receive_fragment_step(uint8_t* port_received, char* fragment, int* fragment_size)
+    * \param Data reception port.
+    * \param Buffer of LORAWAN_FRAME_MAX bytes where the frame received is stored.
+    * \param Pointer associated with the size of the frame received, zero if no frame has been received in this step.
+    * \return State of the reception after this step.
+    * 
+    * Function that performs a single step of the reception like receive_lorawan_step, but returns each frame of a fragmented message on its own, so it can be forwarded before the next one arrives. get_frame_header() tells if more frames follow.
+    */
+    enum lorawan_rx_state receive_fragment_step(uint8_t* port_received, char* fragment, int* fragment_size);
+
+    /**
+    * \fn void close_session()
+    * 
+    * Function that turns off the LoRaWAN module, so the next operation turns it on and joins the network again.
+    */
+    void close_session();
+
+    /**
+    * \fn struct lorawan_session_stats get_session_stats()
+    * \return Time spent in the setup of the connection and in the transfers.
+    * 
+    * Function that returns the time spent by the LoRaWAN connection since the board was started.
+    */
+    struct lorawan_session_stats get_session_stats();
+
+    /**
+    * \fn bool poll_due()
+    * \return True if the polling interval has elapsed since the last downlink poll.
+    * 
+    * Function that indicates if receive_lorawan will poll the gateway in its next call.
+    */
+    bool poll_due();
+
+    /**
+    * \fn void poll_now()
+    * 
+    * Function that makes the next call to receive_lorawan poll the gateway, for example when an answer to an uplink is expected.
+    */
+    void poll_now();
+
+    /**
+    * \fn struct lorawan_poll_stats get_poll_stats()
+    * \return Statistics of the downlink polling.
+    * 
+    * Function that returns the hit rate and the latency of the downlink polling since the board was started.
+    */
+    struct lorawan_poll_stats get_poll_stats();
+
+    /**
+    * \fn void set_fragmentation_timeout(unsigned long timeout)
+    * \param Maximum time (ms) waiting for the next frame of a fragmented message.
+    * 
+    * Function that sets the time after which receive_lorawan gives up a fragmented message whose next frame has not arrived.
+    */
+    void set_fragmentation_timeout(unsigned long timeout);
+
+    /**
+    * \fn struct frame_header get_frame_header()
+    * \return Header of the last frame received.
+    * 
+    * Function that returns the destination network and the purpose of the last frame received, decoded once on reception. With the hexadecimal header, receive_lorawan returns the frames as received. With the binary header, it returns only the payloads, in binary.
+    */
+    struct frame_header get_frame_header();
   
   private:
 
+    /**
+    * \fn uint8_t open_session()
+    * \return 0 if the module is on and joined to the network, or the error of the step that failed.
+    * 
+    * Function that turns on the LoRaWAN module and joins the network by ABP, unless they are already done.
+    */
+    uint8_t open_session();
+
+    /**
+    * \fn uint8_t send_uplink(uint8_t* data_send, uint16_t size_data, bool confirmed)
+    * \param Data to be sent through LoRaWAN.
+    * \param Size of the data to send.
+    * \param True to send a confirmed uplink, false to send an unconfirmed one.
+    * \return Status of the uplink.
+    * 
+    * Function that sends an uplink in the open session. If the module has lost the network it will be joined again, and if the module does not answer it will be turned off and on again in the next operation.
+    */
+    uint8_t send_uplink(uint8_t* data_send, uint16_t size_data, bool confirmed);
+
+    /**
+    * \fn void schedule_poll(bool received, bool pending)
+    * \param True if the last poll received a downlink.
+    * \param True if the received downlink indicates that more frames are pending.
+    * 
+    * Function that updates the polling statistics and the interval until the next poll: it is brought forward when frames are pending, reset after a downlink and doubled after a poll without data.
+    */
+    void schedule_poll(bool received, bool pending);
+
+    /**
+    * \fn void decode_frame_header()
+    * 
+    * Function that decodes the header of the frame received in LoRaWAN._data, in either the hexadecimal or the binary version.
+    */
+    void decode_frame_header();
+
     /** Status variable used for verification on the LoRaWAN connection. */
     uint8_t lorawan_status; 
 
     /** Boolean variable that determines if is stop of receiving LoRaWAN data or no. True -> Start/Continue with data reception. False -> Total data received. It does not continue to receive.*/
-    bool lorawan_receiving;
+    bool lorawan_receiving = false;
 
     /** Numbers of LoRaWAN frames received. */
     int num_lorawan_frames_received;
 
     /** Status LoRWAN reception. */
     bool status_lorawan_reception;
+
+    /** Variable that determines if the LoRaWAN module is on. */
+    bool session_on = false;
+
+    /** Variable that determines if the LoRaWAN module is joined to the network. */
+    bool session_joined = false;
+
+    /** Time spent by the LoRaWAN connection. */
+    struct lorawan_session_stats session_stats = {0, 0, 0, 0, 0};
+
+    /** Time (ms) when the last downlink poll was sent. */
+    unsigned long last_poll_time = 0;
+
+    /** Statistics of the downlink polling. The first poll is sent in the first call. */
+    struct lorawan_poll_stats poll_stats = {0, 0, 0, 0, 0, 0};
+
+    /** Maximum time (ms) waiting for the next frame of a fragmented message. */
+    unsigned long fragmentation_timeout = FRAGMENTATION_TIMEOUT;
+
+    /** Time (ms) when the last frame of the message being received arrived. */
+    unsigned long last_frame_time = 0;
+
+    /** Number of frames of the message being received. */
+    int frames_received = 0;
+
+    /** Interval (ms) until the next poll for a frame of the message being received, after a poll without data. */
+    unsigned long fragment_retry_interval = LORAWAN_FRAGMENT_RETRY_INTERVAL;
+
+    /** Header of the last frame received. */
+    struct frame_header header = {FRAME_HEADER_HEX, 0, 0, false};
     
   protected:
   
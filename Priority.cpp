@@ -0,0 +1,123 @@
+/**
+ * \file Priority.cpp
+ * \brief Program that define the priority queues of the outgoing frames.
+ */
+
+/****************************************************************************
+*                             Includes                                     *
+****************************************************************************/
+#include "Priority.h"
+
+/****************************************************************************
+*                               Objects                                     *
+****************************************************************************/
+
+PriorityQueues vlc_queues = PriorityQueues();
+
+/****************************************************************************
+*                              Variables                                    *
+****************************************************************************/
+
+/** Frames sent from each level per round with weighted scheduling. */
+const uint8_t PRIORITY_WEIGHT [PRIORITY_LEVELS] = PRIORITY_WEIGHTS;
+
+/****************************************************************************
+*                             Functions                                     *
+****************************************************************************/
+
+PriorityQueues::PriorityQueues(){
+  memset(stats, 0, sizeof(stats));
+}
+
+PriorityQueues::~PriorityQueues(){
+
+}
+
+void PriorityQueues::set_policy(enum priority_policy policy){
+  this->policy = policy;
+  memcpy(credits, PRIORITY_WEIGHT, sizeof(credits));
+}
+
+bool PriorityQueues::submit(struct outgoing_frame * frame, uint8_t priority){
+  if(priority >= PRIORITY_LEVELS){
+    return false;
+  }
+  // The queues are bounded, so a full level rejects the frame instead of delaying the other ones.
+  if((uint8_t)(head[priority] - tail[priority]) == PRIORITY_QUEUE_SLOTS){
+    stats[priority].dropped ++;
+    return false;
+  }
+
+  uint8_t slot = head[priority] % PRIORITY_QUEUE_SLOTS;
+  queue[priority][slot] = *frame;
+  submit_time[priority][slot] = millis();
+  head[priority] ++;
+  stats[priority].submitted ++;
+  return true;
+}
+
+bool PriorityQueues::submit(struct outgoing_frame * frame){
+  return submit(frame, purpose_priority(frame->purpose));
+}
+
+bool PriorityQueues::take(uint8_t priority, struct outgoing_frame * frame){
+  if(head[priority] == tail[priority]){
+    return false;
+  }
+
+  uint8_t slot = tail[priority] % PRIORITY_QUEUE_SLOTS;
+  *frame = queue[priority][slot];
+  if(millis() - submit_time[priority][slot] > stats[priority].max_wait){
+    stats[priority].max_wait = millis() - submit_time[priority][slot];
+  }
+  tail[priority] ++;
+  stats[priority].sent ++;
+  return true;
+}
+
+bool PriorityQueues::next(struct outgoing_frame * frame){
+  if(policy == PRIORITY_STRICT){
+    for(uint8_t i=0; i<PRIORITY_LEVELS; i++){
+      if(take(i, frame)){
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Weighted scheduling: the levels with frames share each round in proportion to their weights. When no level with frames has credits left, a new round starts.
+  for(uint8_t round=0; round<2; round++){
+    for(uint8_t i=0; i<PRIORITY_LEVELS; i++){
+      if(credits[i] > 0 && take(i, frame)){
+        credits[i] --;
+        return true;
+      }
+    }
+    memcpy(credits, PRIORITY_WEIGHT, sizeof(credits));
+  }
+  return false;
+}
+
+bool PriorityQueues::next(struct outgoing_frame * frame, uint8_t priority){
+  if(priority >= PRIORITY_LEVELS){
+    return false;
+  }
+  return take(priority, frame);
+}
+
+int PriorityQueues::pending(){
+  int frames = 0;
+  for(uint8_t i=0; i<PRIORITY_LEVELS; i++){
+    frames += (uint8_t)(head[i] - tail[i]);
+  }
+  return frames;
+}
+
+struct priority_stats PriorityQueues::get_stats(uint8_t priority){
+  struct priority_stats level_stats = {0, 0, 0, 0};
+
+  if(priority < PRIORITY_LEVELS){
+    level_stats = stats[priority];
+  }
+  return level_stats;
+}
@@ -0,0 +1,209 @@
+/**
+ * \file Priority.h
+ * \brief Program that define the priority queues of the outgoing frames.
+ */
+
+#ifndef _PRIORITY_H
+#define _PRIORITY_H
+
+/****************************************************************************
+*                             Includes                                     *
+****************************************************************************/
+
+#ifndef __WPROGRAM_H__
+  #include "WaspClasses.h"
+#endif
+
+#include "Frame.h"
+
+/****************************************************************************
+*                             Define                                        *
+****************************************************************************/
+
+/** Number of priority levels. Level 0 is the most urgent one. */
+#define PRIORITY_LEVELS 3
+
+/** Priority of the control traffic: actuators, RTC and MAC requests and answers. */
+#define PRIORITY_CONTROL 0
+
+/** Priority of the sensor data. */
+#define PRIORITY_NORMAL 1
+
+/** Priority of the bulk transfers: VLC and Zigbee data. */
+#define PRIORITY_BULK 2
+
+/** Frames that each priority level can keep waiting. It must be a power of two up to 128. */
+#define PRIORITY_QUEUE_SLOTS 4
+
+/** Frames sent from each level per round with weighted scheduling, from the most urgent level to the least one. */
+#define PRIORITY_WEIGHTS {4, 2, 1}
+
+/****************************************************************************
+*                            Enumerations                                   *
+****************************************************************************/
+
+/** Scheduling of the priority levels. */
+enum priority_policy {
+  PRIORITY_STRICT,  /// The most urgent level with frames is always served first
+  PRIORITY_WEIGHTED /// Each level sends up to its weight of frames per round, so the bulk traffic is never starved
+};
+
+/****************************************************************************
+*                             Structures                                    *
+****************************************************************************/
+
+/** Frame waiting to be sent. The data is not copied, so it must be kept until the frame has been sent. */
+struct outgoing_frame {
+  char * data; /// Data of the frame
+  int size; /// Size of the data
+  uint8_t purpose; /// Purpose of the frame (FramePurpouse)
+  bool fragment; /// Determines if the frame is a fragment of a message, sent in order with the other fragments of its level
+  bool first; /// Determines if the frame is the first fragment of its message
+  bool last; /// Determines if the frame is the last fragment of its message
+  uint8_t tag; /// Value kept for the user, for example the buffer of the data
+  int fragment_size; /// Size of the fragments of a message that is split when it is sent, 0 if it is sent in one frame
+};
+
+/** Counters of a priority level. */
+struct priority_stats {
+  unsigned int submitted; /// Frames queued
+  unsigned int dropped; /// Frames rejected because the level was full
+  unsigned int sent; /// Frames taken from the queue to be sent
+  unsigned long max_wait; /// Maximum time (ms) that a frame has waited in the queue
+};
+
+class PriorityQueues{
+  public:
+
+    /**
+    * \fn PriorityQueues()
+    * 
+    * Class constructor.
+    */
+    PriorityQueues();
+
+    /**
+    * \fn ~PriorityQueues()
+    * 
+    * Class destructor.
+    */
+    ~PriorityQueues();
+
+    /**
+    * \fn void set_policy(enum priority_policy policy)
+    * \param Scheduling of the priority levels.
+    * 
+    * Function that selects strict or weighted scheduling. The weights of the levels are defined by PRIORITY_WEIGHTS.
+    */
+    void set_policy(enum priority_policy policy);
+
+    /**
+    * \fn bool submit(struct outgoing_frame * frame, uint8_t priority)
+    * \param Frame to send.
+    * \param Priority level of the frame, from PRIORITY_CONTROL to PRIORITY_BULK.
+    * \return True if the frame has been queued. False if the level is full or does not exist.
+    * 
+    * Function that puts a frame in the queue of a priority level.
+    */
+    bool submit(struct outgoing_frame * frame, uint8_t priority);
+
+    /**
+    * \fn bool submit(struct outgoing_frame * frame)
+    * \param Frame to send.
+    * \return True if the frame has been queued. False if the level is full.
+    * 
+    * Function that puts a frame in the queue of the priority level of its purpose.
+    */
+    bool submit(struct outgoing_frame * frame);
+
+    /**
+    * \fn bool next(struct outgoing_frame * frame)
+    * \param Pointer where the next frame to send is stored.
+    * \return True if a frame has been taken from the queues. False if they are empty.
+    * 
+    * Function that takes the next frame to send according to the policy. It is called at each frame boundary of the link, so the urgent frames go before the bulk frames already waiting.
+    */
+    bool next(struct outgoing_frame * frame);
+
+    /**
+    * \fn bool next(struct outgoing_frame * frame, uint8_t priority)
+    * \param Pointer where the next frame to send is stored.
+    * \param Priority level of the frame, from PRIORITY_CONTROL to PRIORITY_BULK.
+    * \return True if a frame has been taken from the level. False if it is empty or does not exist.
+    * 
+    * Function that takes the oldest frame of a priority level, whatever the policy. It lets the link send the urgent frames between the frames of a message that is being sent.
+    */
+    bool next(struct outgoing_frame * frame, uint8_t priority);
+
+    /**
+    * \fn int pending()
+    * \return Number of frames waiting in every level.
+    */
+    int pending();
+
+    /**
+    * \fn struct priority_stats get_stats(uint8_t priority)
+    * \param Priority level.
+    * \return Counters of the level.
+    * 
+    * Function that returns the frames queued, dropped and sent and the longest wait of a priority level.
+    */
+    struct priority_stats get_stats(uint8_t priority);
+
+    /**
+    * \fn static constexpr uint8_t purpose_priority(uint8_t purpose)
+    * \param Purpose of the frame (FramePurpouse).
+    * \return Priority level of the purpose.
+    */
+    static constexpr uint8_t purpose_priority(uint8_t purpose){
+      return (purpose == ACTUATOR || purpose == RTC_TIME || purpose == MAC_REQUEST || purpose == MAC_ANSWER) ? PRIORITY_CONTROL :
+             (purpose == BOARD_SENSOR || purpose == EXTERNAL_SENSOR) ? PRIORITY_NORMAL : PRIORITY_BULK;
+    }
+
+  private:
+
+    /**
+    * \fn bool take(uint8_t priority, struct outgoing_frame * frame)
+    * \param Priority level.
+    * \param Pointer where the frame is stored.
+    * \return True if the level had a frame.
+    * 
+    * Function that takes the oldest frame of a priority level.
+    */
+    bool take(uint8_t priority, struct outgoing_frame * frame);
+
+    /** Frames waiting in each level. The slot used is index % PRIORITY_QUEUE_SLOTS. */
+    struct outgoing_frame queue [PRIORITY_LEVELS][PRIORITY_QUEUE_SLOTS];
+
+    /** Time (ms) when each frame was queued. */
+    unsigned long submit_time [PRIORITY_LEVELS][PRIORITY_QUEUE_SLOTS];
+
+    /** Index of the next frame to queue in each level. */
+    uint8_t head [PRIORITY_LEVELS] = {0};
+
+    /** Index of the next frame to send in each level. */
+    uint8_t tail [PRIORITY_LEVELS] = {0};
+
+    /** Frames that each level can still send in this round with weighted scheduling. */
+    uint8_t credits [PRIORITY_LEVELS] = PRIORITY_WEIGHTS;
+
+    /** Selected scheduling. */
+    enum priority_policy policy = PRIORITY_STRICT;
+
+    /** Counters of each level. */
+    struct priority_stats stats [PRIORITY_LEVELS];
+
+  protected:
+
+};
+
+static_assert(PRIORITY_QUEUE_SLOTS <= 128 && (PRIORITY_QUEUE_SLOTS & (PRIORITY_QUEUE_SLOTS - 1)) == 0, "The slots of each level must be a power of two up to 128");
+
+/****************************************************************************
+*                             Objects                                       *
+****************************************************************************/
+
+/** Frames waiting to be sent through VLC. */
+extern PriorityQueues vlc_queues;
+
+#endif
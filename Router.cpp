@@ -0,0 +1,70 @@
+/**
+ * \file Router.cpp
+ * \brief Program that define the routing of the received frames to their handlers.
+ */
+
+/****************************************************************************
+*                             Includes                                     *
+****************************************************************************/
+#include "Router.h"
+
+/****************************************************************************
+*                               Objects                                     *
+****************************************************************************/
+
+Router router_object = Router();
+
+/****************************************************************************
+*                             Functions                                     *
+****************************************************************************/
+
+Router::Router(){
+
+}
+
+Router::~Router(){
+
+}
+
+bool Router::register_handler(uint8_t networks, uint8_t purpose, frame_handler handler){
+  // Only the networks and purposes of the table can be registered.
+  if(networks == 0 || (networks >> ROUTER_NETWORKS) != 0 || purpose >= ROUTER_PURPOSES){
+    return false;
+  }
+
+  for(uint8_t i=0; i<ROUTER_NETWORKS; i++){
+    if(networks & (1 << i)){
+      handlers[i][purpose] = handler;
+    }
+  }
+  return true;
+}
+
+uint8_t Router::route(struct frame_header* header, char* data, int size, int fragment_size){
+  uint8_t handled = 0;
+  uint8_t purpose = purpose_index(header->purpose);
+
+  // A single table lookup per network of the destination.
+  for(uint8_t i=0; i<ROUTER_NETWORKS; i++){
+    if(header->network & (1 << i)){
+      frame_handler handler = handlers[i][purpose];
+      if(handler == NULL){
+        handler = handlers[i][ROUTER_DEFAULT_PURPOSE];
+      }
+
+      #if DEBUG_ROUTER == 1
+        USB.print(F("Network "));
+        USB.print(1 << i, DEC);
+        USB.print(F(" - Purpose "));
+        USB.print(header->purpose, DEC);
+        USB.println(handler == NULL ? F(" not handled") : F(" handled"));
+      #endif
+
+      if(handler != NULL){
+        handler(1 << i, header->purpose, data, size, fragment_size);
+        handled ++;
+      }
+    }
+  }
+  return handled;
+}
@@ -0,0 +1,110 @@
+/**
+ * \file Router.h
+ * \brief Program that define the routing of the received frames to their handlers.
+ */
+
+#ifndef _ROUTER_H
+#define _ROUTER_H
+
+/****************************************************************************
+*                             Includes                                     *
+****************************************************************************/
+
+#ifndef __WPROGRAM_H__
+  #include "WaspClasses.h"
+#endif
+
+#include "Frame.h"
+
+/****************************************************************************
+*                             Define                                        *
+****************************************************************************/
+
+/** Message debug. */
+#define DEBUG_ROUTER 0
+
+/** Number of networks of the handler table. The network identifiers are the bits 0 to ROUTER_NETWORKS-1 of the destination network. */
+#define ROUTER_NETWORKS 3
+
+/** Number of purposes of the handler table. The entry 0 holds the default handler of each network. */
+#define ROUTER_PURPOSES (RTC_TIME + 1)
+
+/** Purpose used to register the default handler of a network, called for purposes without a handler of their own. */
+#define ROUTER_DEFAULT_PURPOSE 0
+
+/****************************************************************************
+*                             Types                                         *
+****************************************************************************/
+
+/**
+* Handler of the frames directed to a network with a purpose. It receives the network identifier, the purpose, the data received, its size and the size of its fragments (zero if it is not fragmented).
+*/
+typedef void (*frame_handler)(uint8_t network, uint8_t purpose, char* data, int size, int fragment_size);
+
+class Router{
+  public:
+
+    /**
+    * \fn Router()
+    * 
+    * Class constructor.
+    */
+    Router();
+
+    /**
+    * \fn ~Router()
+    * 
+    * Class destructor.
+    */
+    ~Router();
+
+    /**
+    * \fn bool register_handler(uint8_t networks, uint8_t purpose, frame_handler handler)
+    * \param Network identifiers (one or several bits) to which the handler is registered.
+    * \param Purpose (FramePurpouse) handled, or ROUTER_DEFAULT_PURPOSE for the purposes without a handler of their own.
+    * \param Handler called for the frames, or NULL to remove the handler.
+    * \return True if the handler has been registered. False if the network or the purpose are not in the table.
+    * 
+    * Function that registers the handler of the frames directed to some networks with a purpose, replacing the previous one.
+    */
+    bool register_handler(uint8_t networks, uint8_t purpose, frame_handler handler);
+
+    /**
+    * \fn uint8_t route(struct frame_header* header, char* data, int size, int fragment_size)
+    * \param Header of the received frame.
+    * \param Data received.
+    * \param Size of the data received.
+    * \param Size of the data fragments, zero if it is not fragmented.
+    * \return Number of handlers called.
+    * 
+    * Function that calls, for each network of the destination, the handler of the purpose of the frame or, if there is none, the default handler of the network.
+    */
+    uint8_t route(struct frame_header* header, char* data, int size, int fragment_size);
+
+  private:
+
+    /**
+    * \fn static constexpr uint8_t purpose_index(uint8_t purpose)
+    * \param Purpose of the frame.
+    * \return Entry of the handler table of the purpose, or ROUTER_DEFAULT_PURPOSE if it is unknown.
+    */
+    static constexpr uint8_t purpose_index(uint8_t purpose){
+      return purpose < ROUTER_PURPOSES ? purpose : ROUTER_DEFAULT_PURPOSE;
+    }
+
+    /** Handlers indexed by network bit and purpose. */
+    frame_handler handlers[ROUTER_NETWORKS][ROUTER_PURPOSES] = {};
+
+  protected:
+
+};
+
+static_assert(LORAWAN_NETWORK == (1 << 0) && VLC_NETWORK == (1 << 1) && ZIGBEE_NETWORK == (1 << 2), "The network identifiers must be the bits of the handler table");
+
+/****************************************************************************
+*                             Objects                                       *
+****************************************************************************/
+
+extern Router router_object;
+
+#endif
@@ -0,0 +1,75 @@
+/**
+ * \file Scheduler.cpp
+ * \brief Program that define the cooperative scheduler of the main loop tasks.
+ */
+
+/****************************************************************************
+*                             Includes                                     *
+****************************************************************************/
+#include "Scheduler.h"
+
+/****************************************************************************
+*                               Objects                                     *
+****************************************************************************/
+
+Scheduler scheduler_object = Scheduler();
+
+/****************************************************************************
+*                             Functions                                     *
+****************************************************************************/
+
+Scheduler::Scheduler(){
+
+}
+
+Scheduler::~Scheduler(){
+
+}
+
+int Scheduler::add_task(scheduler_task task){
+  if(num_tasks >= SCHEDULER_MAX_TASKS){
+    return -1;
+  }
+
+  tasks[num_tasks] = task;
+  wake_time[num_tasks] = millis();
+  sleeping[num_tasks] = false;
+  memset(&stats[num_tasks], 0, sizeof(stats[num_tasks]));
+  return num_tasks++;
+}
+
+void Scheduler::wake_task(int task){
+  if(task >= 0 && task < num_tasks){
+    wake_time[task] = millis();
+    sleeping[task] = false;
+  }
+}
+
+void Scheduler::run(){
+  for(uint8_t i=0; i<num_tasks; i++){
+    unsigned long start_time = millis();
+
+    // The difference is compared instead of the times, so the overflow of millis() does not stop the tasks.
+    if(!sleeping[i] && (long)(start_time - wake_time[i]) >= 0){
+      unsigned long wait = tasks[i]();
+      unsigned long end_time = millis();
+
+      wake_time[i] = end_time + wait;
+      sleeping[i] = (wait == SCHEDULER_SLEEP);
+      stats[i].runs ++;
+      stats[i].busy_time += end_time - start_time;
+      if(end_time - start_time > stats[i].max_time){
+        stats[i].max_time = end_time - start_time;
+      }
+    }
+  }
+}
+
+struct scheduler_task_stats Scheduler::get_task_stats(int task){
+  struct scheduler_task_stats task_stats = {0, 0, 0};
+
+  if(task >= 0 && task < num_tasks){
+    task_stats = stats[task];
+  }
+  return task_stats;
+}
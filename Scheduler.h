@@ -0,0 +1,124 @@
+/**
+ * \file Scheduler.h
+ * \brief Program that define the cooperative scheduler of the main loop tasks.
+ */
+
+#ifndef _SCHEDULER_H
+#define _SCHEDULER_H
+
+/****************************************************************************
+*                             Includes                                     *
+****************************************************************************/
+
+#ifndef __WPROGRAM_H__
+  #include "WaspClasses.h"
+#endif
+
+/****************************************************************************
+*                             Define                                        *
+****************************************************************************/
+
+/** Maximum number of tasks of the scheduler. */
+#define SCHEDULER_MAX_TASKS 6
+
+/** Time returned by a task that has no work left, so it is only called again once wake_task() is called. */
+#define SCHEDULER_SLEEP 0xFFFFFFFF
+
+/****************************************************************************
+*                             Types                                         *
+****************************************************************************/
+
+/**
+* Task of the scheduler. It performs one step of its work without waiting, and returns the time (ms) after which it has to be called again (0 to be called in the next pass, SCHEDULER_SLEEP to wait until it is woken).
+*/
+typedef unsigned long (*scheduler_task)();
+
+/****************************************************************************
+*                             Structures                                    *
+****************************************************************************/
+
+/** Statistics of a task. */
+struct scheduler_task_stats {
+  unsigned long runs; /// Times that the task has been called
+  unsigned long busy_time; /// Time (ms) spent in the task
+  unsigned long max_time; /// Maximum time (ms) of a single call, which delays every other task
+};
+
+class Scheduler{
+  public:
+
+    /**
+    * \fn Scheduler()
+    * 
+    * Class constructor.
+    */
+    Scheduler();
+
+    /**
+    * \fn ~Scheduler()
+    * 
+    * Class destructor.
+    */
+    ~Scheduler();
+
+    /**
+    * \fn int add_task(scheduler_task task)
+    * \param Task to be called by the scheduler.
+    * \return Identifier of the task, or -1 if there are already SCHEDULER_MAX_TASKS tasks.
+    * 
+    * Function that adds a task, which is called in the next pass of the scheduler.
+    */
+    int add_task(scheduler_task task);
+
+    /**
+    * \fn void wake_task(int task)
+    * \param Identifier of the task.
+    * 
+    * Function that makes a task be called in the next pass, for example when another task has left work for it.
+    */
+    void wake_task(int task);
+
+    /**
+    * \fn void run()
+    * 
+    * Function that performs a pass of the scheduler, calling in order every task whose waiting time has elapsed. It is called from loop().
+    */
+    void run();
+
+    /**
+    * \fn struct scheduler_task_stats get_task_stats(int task)
+    * \param Identifier of the task.
+    * \return Statistics of the task.
+    * 
+    * Function that returns the calls and the time spent in a task since it was added.
+    */
+    struct scheduler_task_stats get_task_stats(int task);
+
+  private:
+
+    /** Tasks of the scheduler. */
+    scheduler_task tasks[SCHEDULER_MAX_TASKS];
+
+    /** Time (ms) when each task has to be called again. */
+    unsigned long wake_time[SCHEDULER_MAX_TASKS];
+
+    /** Determines if each task is waiting for wake_task(). */
+    bool sleeping[SCHEDULER_MAX_TASKS];
+
+    /** Statistics of each task. */
+    struct scheduler_task_stats stats[SCHEDULER_MAX_TASKS];
+
+    /** Number of tasks added. */
+    uint8_t num_tasks = 0;
+
+  protected:
+
+};
+
+/****************************************************************************
+*                             Objects                                       *
+****************************************************************************/
+
+extern Scheduler scheduler_object;
+
+#endif
@@ -22,17 +22,134 @@ VLC vlc_object = VLC();
 
 enum receiver_state frame_state = WAITING_SYNCHRONIZE;
 
+/****************************************************************************
+*                              Tables                                       *
+****************************************************************************/
+
+#define MANCHESTER_WORD_4(b)  MANCHESTER_WORD(b), MANCHESTER_WORD((b) + 1), MANCHESTER_WORD((b) + 2), MANCHESTER_WORD((b) + 3)
+#define MANCHESTER_WORD_16(b) MANCHESTER_WORD_4(b), MANCHESTER_WORD_4((b) + 4), MANCHESTER_WORD_4((b) + 8), MANCHESTER_WORD_4((b) + 12)
+#define MANCHESTER_WORD_64(b) MANCHESTER_WORD_16(b), MANCHESTER_WORD_16((b) + 16), MANCHESTER_WORD_16((b) + 32), MANCHESTER_WORD_16((b) + 48)
+
+/** Manchester words (start, data and stop half bits) of every byte, built at compile time and stored in flash. */
+const unsigned long int manchester_table[256] PROGMEM = {
+  MANCHESTER_WORD_64(0x00), MANCHESTER_WORD_64(0x40), MANCHESTER_WORD_64(0x80), MANCHESTER_WORD_64(0xC0)
+};
+
+/** 4B6B code of each nibble, with the first chip to send in the least significant bit. */
+const unsigned char code_4b6b_table[16] PROGMEM = {
+  0x1C, 0x2C, 0x32, 0x1A, 0x2A, 0x31, 0x19, 0x29, 0x26, 0x16, 0x0E, 0x23, 0x13, 0x25, 0x15, 0x0D
+};
+
+/** Nibble of each byte of a received Manchester character: the first pair of chips (least significant bits) is the most significant bit of the nibble, 01 is a 1 and 10 is a 0. 0xFF marks the bytes with a 00 or 11 pair, which is not a valid Manchester bit. */
+const unsigned char manchester_decode_table[256] PROGMEM = {
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x0F, 0x07, 0xFF, 0xFF, 0x0B, 0x03, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x0D, 0x05, 0xFF, 0xFF, 0x09, 0x01, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x0E, 0x06, 0xFF, 0xFF, 0x0A, 0x02, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x0C, 0x04, 0xFF, 0xFF, 0x08, 0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
+
+/** Nibble of each 6-chip code as it is received (first chip in the most significant bit). 0xFF marks the invalid codes. */
+const unsigned char decode_4b6b_table[64] PROGMEM = {
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x01, 0x00, 0xFF,
+  0xFF, 0xFF, 0xFF, 0x02, 0xFF, 0x04, 0x03, 0xFF,
+  0xFF, 0x08, 0x09, 0xFF, 0x0A, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0x05, 0xFF, 0x07, 0x06, 0xFF,
+  0xFF, 0x0D, 0x0E, 0xFF, 0x0F, 0xFF, 0xFF, 0xFF,
+  0xFF, 0x0B, 0x0C, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
+
+/** Extended Hamming(8,4) code of each nibble: Hamming(7,4) in bits 0-6 and overall parity in bit 7. */
+const unsigned char hamming_encode_table[16] PROGMEM = {
+  0x00, 0x87, 0x99, 0x1E, 0xAA, 0x2D, 0x33, 0xB4, 0x4B, 0xCC, 0xD2, 0x55, 0xE1, 0x66, 0x78, 0xFF
+};
+
+/** Nibble of each received extended Hamming(8,4) code. 0x10 marks a corrected single error and 0xFF a double error that can not be corrected. */
+const unsigned char hamming_decode_table[256] PROGMEM = {
+  0x00, 0x10, 0x10, 0xFF, 0x10, 0xFF, 0xFF, 0x11, 0x10, 0xFF, 0xFF, 0x18, 0xFF, 0x15, 0x13, 0xFF,
+  0x10, 0xFF, 0xFF, 0x16, 0xFF, 0x1B, 0x13, 0xFF, 0xFF, 0x12, 0x13, 0xFF, 0x13, 0xFF, 0x03, 0x13,
+  0x10, 0xFF, 0xFF, 0x16, 0xFF, 0x15, 0x1D, 0xFF, 0xFF, 0x15, 0x14, 0xFF, 0x15, 0x05, 0xFF, 0x15,
+  0xFF, 0x16, 0x16, 0x06, 0x17, 0xFF, 0xFF, 0x16, 0x1E, 0xFF, 0xFF, 0x16, 0xFF, 0x15, 0x13, 0xFF,
+  0x10, 0xFF, 0xFF, 0x18, 0xFF, 0x1B, 0x1D, 0xFF, 0xFF, 0x18, 0x18, 0x08, 0x19, 0xFF, 0xFF, 0x18,
+  0xFF, 0x1B, 0x1A, 0xFF, 0x1B, 0x0B, 0xFF, 0x1B, 0x1E, 0xFF, 0xFF, 0x18, 0xFF, 0x1B, 0x13, 0xFF,
+  0xFF, 0x1C, 0x1D, 0xFF, 0x1D, 0xFF, 0x0D, 0x1D, 0x1E, 0xFF, 0xFF, 0x18, 0xFF, 0x15, 0x1D, 0xFF,
+  0x1E, 0xFF, 0xFF, 0x16, 0xFF, 0x1B, 0x1D, 0xFF, 0x0E, 0x1E, 0x1E, 0xFF, 0x1E, 0xFF, 0xFF, 0x1F,
+  0x10, 0xFF, 0xFF, 0x11, 0xFF, 0x11, 0x11, 0x01, 0xFF, 0x12, 0x14, 0xFF, 0x19, 0xFF, 0xFF, 0x11,
+  0xFF, 0x12, 0x1A, 0xFF, 0x17, 0xFF, 0xFF, 0x11, 0x12, 0x02, 0xFF, 0x12, 0xFF, 0x12, 0x13, 0xFF,
+  0xFF, 0x1C, 0x14, 0xFF, 0x17, 0xFF, 0xFF, 0x11, 0x14, 0xFF, 0x04, 0x14, 0xFF, 0x15, 0x14, 0xFF,
+  0x17, 0xFF, 0xFF, 0x16, 0x07, 0x17, 0x17, 0xFF, 0xFF, 0x12, 0x14, 0xFF, 0x17, 0xFF, 0xFF, 0x1F,
+  0xFF, 0x1C, 0x1A, 0xFF, 0x19, 0xFF, 0xFF, 0x11, 0x19, 0xFF, 0xFF, 0x18, 0x09, 0x19, 0x19, 0xFF,
+  0x1A, 0xFF, 0x0A, 0x1A, 0xFF, 0x1B, 0x1A, 0xFF, 0xFF, 0x12, 0x1A, 0xFF, 0x19, 0xFF, 0xFF, 0x1F,
+  0x1C, 0x0C, 0xFF, 0x1C, 0xFF, 0x1C, 0x1D, 0xFF, 0xFF, 0x1C, 0x14, 0xFF, 0x19, 0xFF, 0xFF, 0x1F,
+  0xFF, 0x1C, 0x1A, 0xFF, 0x17, 0xFF, 0xFF, 0x1F, 0x1E, 0xFF, 0xFF, 0x1F, 0xFF, 0x1F, 0x1F, 0x0F
+};
+
+#define VLC_RATE_PROFILE(RATE, PRESCALER) { vlc_timing<RATE, PRESCALER>::prescaler_bits, vlc_timing<RATE, PRESCALER>::prescaler_shift, vlc_timing<RATE, PRESCALER>::emitter_compare, vlc_timing<RATE, PRESCALER>::receiver_compare, vlc_timing<RATE, PRESCALER>::usart_ubrr }
+
+/** Timer3 configuration of each communication frequency, indexed by enum vlc_rate. */
+const struct vlc_rate_profile vlc_rate_profiles[VLC_RATE_COUNT] PROGMEM = {
+  VLC_RATE_PROFILE(1000, 8),   /// VLC_RATE_1K
+  VLC_RATE_PROFILE(2000, 8),   /// VLC_RATE_2K
+  VLC_RATE_PROFILE(4000, 1),   /// VLC_RATE_4K
+  VLC_RATE_PROFILE(8000, 1),   /// VLC_RATE_8K
+  VLC_RATE_PROFILE(16000, 1)   /// VLC_RATE_16K
+};
+
 /****************************************************************************
 *                             Functions                                     *
 ****************************************************************************/
 
 ISR( TIMER3_COMPA_vect ){
+  #if VLC_ISR_STATS == 1
+    // The timer is cleared at the compare match, so its value is the latency of the interrupt.
+    unsigned int entry_ticks = TCNT3 ;
+  #endif
   if (VLC_TRANSCEIVER){ // Module defined as transmitter.
     vlc_object.send_half_bit();
   }else{ // Module defined as receiver. 
     vlc_object.sample_data();
   }
+  #if VLC_ISR_STATS == 1
+    vlc_object.record_isr(entry_ticks, TCNT3, TIFR3 & (1 << OCF3A));
+  #endif
+}
+
+#if VLC_TX_BACKEND == VLC_TX_BACKEND_USART
+ISR( VLC_USART_UDRE_vect ){
+  vlc_object.send_usart_byte();
+}
+#endif
+
+#if VLC_RX_FRONTEND == VLC_RX_FRONTEND_ADC
+ISR( ADC_vect ){
+  // The compare flag is cleared so that the next compare match triggers a new conversion.
+  TIFR1 = (1 << OCF1B) ;
+  #if VLC_ADC_8BIT == 1
+    vlc_object.process_sample(ADCH);
+  #else
+    vlc_object.process_sample(ADC);
+  #endif
 }
+#endif
+
+#if VLC_RX_FRONTEND == VLC_RX_FRONTEND_CAPTURE
+ISR( TIMER1_CAPT_vect ){
+  vlc_object.capture_edge(ICR1);
+}
+#endif
 
 VLC::VLC(){
   
@@ -42,24 +159,43 @@ VLC::~VLC(){
   
 }
 
+int VLC::set_rate(enum vlc_rate rate){
+  if((unsigned int)rate >= VLC_RATE_COUNT){
+    return -1 ;
+  }
+  #if VLC_TX_BACKEND == VLC_TX_BACKEND_USART
+    // The slowest frequencies do not fit in the baud rate register of the USART.
+    if(VLC_TRANSCEIVER && pgm_read_word(&(vlc_rate_profiles[rate].usart_ubrr)) == VLC_USART_UNSUPPORTED){
+      return -1 ;
+    }
+  #endif
+  this->rate = rate ;
+  return 0 ;
+}
+
 void VLC::start_timer() {
+  // The configuration of the selected frequency is read from the table.
+  unsigned char prescaler_bits = pgm_read_byte(&(vlc_rate_profiles[rate].prescaler_bits));
+  unsigned int comparator_value;
+  if (VLC_TRANSCEIVER){ // Module defined as transmitter.
+    comparator_value = pgm_read_word(&(vlc_rate_profiles[rate].emitter_compare));
+  }else{ // Module defined as receiver. The frequency will go in relation to the oversampling capacity to be applied.
+    comparator_value = pgm_read_word(&(vlc_rate_profiles[rate].receiver_compare));
+  }
+  #if VLC_ISR_STATS == 1
+    isr_prescaler_shift = pgm_read_byte(&(vlc_rate_profiles[rate].prescaler_shift));
+  #endif
   // Disable all interruptions to proceed to its configuration.
   cli();
   // The interruption records are set to zero
   TCCR3A = 0;
   TCCR3B = 0;
   // The value associated with the frequency is given.
-  int comparator_value;
-  if (VLC_TRANSCEIVER){ // Module defined as transmitter.
-    comparator_value = (BOARD_FREQUENCY/8)/COMMUNICATION_FREQUENCY;
-  }else{ // Module defined as receiver. The frequency will go in relation to the oversampling capacity to be applied.
-    comparator_value = ((BOARD_FREQUENCY/8)/COMMUNICATION_FREQUENCY)/NUMBER_OF_SAMPLES;
-  }
   OCR3A = comparator_value;
   // The timer interrupt is activated.
   TCCR3B |= ( 1 << WGM32 );
   // The bits that indicate to the micro the type of prescaler to be used are activated.
-  TCCR3B |= ( 1 << CS31 );
+  TCCR3B |= prescaler_bits;
   // The bit indicating the microphone to be notified when it reaches the counter is activated
   TIMSK3 |= ( 1 << OCIE3A );
   // Interruptions are activated.
@@ -85,123 +221,824 @@ void VLC::send_half_bit(){
    bit_counter-- ;
    manchester_data = (manchester_data >> 1);
    if(bit_counter == 0){   
-      manchester_data = 0xAAAAAAAA ;
-      if(frame_index >= 0 ){
-        if(frame_index < frame_size){
-          data_to_manchester(frame_buffer[frame_index], &manchester_data);
-          frame_index ++ ;
-        }else{
-          frame_index = -1 ;
-          frame_size = -1 ;
-        }
+      next_word();
+      bit_counter = word_length ;
+    }
+}
+
+#if VLC_TX_BACKEND == VLC_TX_BACKEND_USART
+void VLC::send_usart_byte(){
+  // Whole words are added to the half bits pending until there are enough to fill a byte of the USART.
+  if(tx_pending_bits < 8){
+    if(!next_word()){
+      return ;
+    }
+    tx_pending |= (manchester_data & ((1UL << word_length) - 1)) << tx_pending_bits ;
+    tx_pending_bits += word_length ;
+  }
+  VLC_UDR = tx_pending & 0xFF ;
+  tx_pending >>= 8 ;
+  tx_pending_bits -= 8 ;
+}
+#endif
+
+void VLC::start_emission(){
+  // The emission starts from a complete word with the lamp on.
+  manchester_data = 0xFFFFFFFF ;
+  bit_counter = word_length ;
+  #if VLC_TX_BACKEND == VLC_TX_BACKEND_USART
+    tx_pending = (1UL << word_length) - 1 ;
+    tx_pending_bits = word_length ;
+    // The USART is configured each time, since its pins can be shared with a socket of the board.
+    VLC_USART_PORT |= (1 << VLC_USART_TXD_BIT) ;
+    VLC_USART_DDR |= (1 << VLC_USART_TXD_BIT) | (1 << VLC_USART_XCK_BIT) ;
+    VLC_UBRR = 0 ;
+    VLC_UCSRC = (1 << VLC_UMSEL1) | (1 << VLC_UMSEL0) | (1 << VLC_UDORD) ;
+    VLC_UCSRB = (1 << VLC_TXEN) ;
+    VLC_UBRR = pgm_read_word(&(vlc_rate_profiles[rate].usart_ubrr));
+    // The data register is empty, so the interrupt loads the first byte at once.
+    VLC_UCSRB |= (1 << VLC_UDRIE) ;
+  #else
+    start_timer();
+  #endif
+}
+
+void VLC::stop_emission(){
+  #if VLC_TX_BACKEND == VLC_TX_BACKEND_USART
+    // The bytes already loaded are shifted out before the transmitter releases the pin, which is left at high level.
+    VLC_UCSRB &= ~((1 << VLC_UDRIE) | (1 << VLC_TXEN)) ;
+  #else
+    TCCR3B = 0 ;
+    PIN_ON();
+  #endif
+  tx_running = false ;
+}
+
+bool VLC::next_word(){
+  manchester_data = 0xAAAAAAAA ;
+  if(frame_index >= 0 && frame_index >= frame_size){
+    frame_index = -1 ;
+    frame_size = -1 ;
+    // The slot is released and the end of the emission is notified.
+    tx_tail ++ ;
+    if(tx_callback != NULL){
+      tx_callback((unsigned char)(tx_tail - 1));
+    }
+    if(tx_tail != tx_head && tx_queue[tx_tail % VLC_TX_QUEUE_SLOTS].continuation){
+      // A streamed fragment follows the previous frame at once, so its preamble is not sent.
+      frame_index = PREAMBLE_SIZE ;
+      frame_size = tx_queue[tx_tail % VLC_TX_QUEUE_SLOTS].size ;
+      tx_fec_low = false ;
+    }
+    // Otherwise an idle word is sent, so the last run of the frame ends with an edge.
+  }else if(frame_index < 0 && tx_tail != tx_head){
+    // The next frame of the transmit queue is taken, starting by its preamble.
+    frame_index = 0 ;
+    frame_size = tx_queue[tx_tail % VLC_TX_QUEUE_SLOTS].size ;
+    tx_fec_low = false ;
+  }else if(frame_index < 0 && !tx_streaming && !tx_message_streaming){
+    // If the queue is empty, the emission is stopped and the lamp is turned on.
+    stop_emission();
+    return false ;
+  }
+  if(frame_index >= 0){
+    struct vlc_tx_slot * slot = &(tx_queue[tx_tail % VLC_TX_QUEUE_SLOTS]);
+    #if VLC_PRECODED_FRAME == 1
+    if(slot->encoded){
+      manchester_data = slot->words[frame_index];
+    }else
+    #endif
+    if(frame_index == PREAMBLE_SIZE - 1){
+      sync_to_word(&manchester_data);
+    }else if(slot->fec && frame_index > PREAMBLE_SIZE){
+      // Each byte after the flag is sent as two Hamming codes, most significant nibble first.
+      unsigned char data = frame_byte(&(slot->frame), frame_index);
+      encode_data(pgm_read_byte(&hamming_encode_table[tx_fec_low ? (data & 0x0F) : (data >> 4)]), &manchester_data);
+      tx_fec_low = !tx_fec_low ;
+      if(tx_fec_low){
+        frame_index -- ;
       }
-      bit_counter = WORD_LENGTH * 2 ;
+    }else{
+      encode_data(frame_byte(&(slot->frame), frame_index), &manchester_data);
     }
+    frame_index ++ ;
+  }
+  return true ;
 }
 
 void VLC::data_to_manchester(unsigned char data, unsigned long int * data_manchester){
-  unsigned int i ;
- (*data_manchester) = 0x02 ; // STOP symbol
- (*data_manchester) = (*data_manchester) << 2 ;
-  for(i = 0 ; i < 8; i ++){
-    if(data & 0x80) (*data_manchester) |=  0x02  ; // data LSB first
-    else (*data_manchester) |= 0x01 ;
-    (*data_manchester) = (*data_manchester) << 2 ;
-    data = data << 1 ; // to next bit
+  // STOP symbol, data LSB first and START symbol are already composed in the table.
+  (*data_manchester) = pgm_read_dword(&manchester_table[data]);
+}
+
+void VLC::data_to_4b6b(unsigned char data, unsigned long int * data_4b6b){
+  // The code of the most significant nibble is sent first.
+  (*data_4b6b) = pgm_read_byte(&code_4b6b_table[data >> 4]) | ((unsigned long int)pgm_read_byte(&code_4b6b_table[data & 0x0F]) << 6);
+}
+
+void VLC::sync_to_word(unsigned long int * word){
+  if(line_code == VLC_LINE_CODE_4B6B){
+    (*word) = SYNC_WORD_4B6B ;
+  }else{
+    data_to_manchester(SYNCHRONIZE_SYMBOL, word);
+  }
+}
+
+void VLC::encode_data(unsigned char data, unsigned long int * word){
+  if(line_code == VLC_LINE_CODE_4B6B){
+    data_to_4b6b(data, word);
+  }else{
+    data_to_manchester(data, word);
+  }
+}
+
+int VLC::decode_character(unsigned int character, bool guess){
+  unsigned char nibbles [2] ;
+  bool valid = true ;
+  if(line_code == VLC_LINE_CODE_4B6B){
+    if(character == SYNC_SYMBOL_4B6B){
+      return SYNCHRONIZE_SYMBOL ;
+    }
+    // Each nibble that can be received is marked in a mask. A wrong chip gives an invalid code, which marks the nibbles of the valid codes with the fewest different chips.
+    unsigned int candidates [2] ;
+    for(int i = 0 ; i < 2 ; i ++){
+      unsigned char code = (character >> (i ? 0 : 6)) & 0x3F ;
+      nibbles[i] = pgm_read_byte(&decode_4b6b_table[code]);
+      candidates[i] = 1 << (nibbles[i] & 0x0F) ;
+      if(nibbles[i] == 0xFF){
+        valid = false ;
+        unsigned char best_distance = 7 ;
+        for(unsigned char valid_code = 0 ; valid_code < 64 ; valid_code ++){
+          unsigned char nibble = pgm_read_byte(&decode_4b6b_table[valid_code]);
+          unsigned char distance = 0 ;
+          for(unsigned char chips = code ^ valid_code ; chips ; chips &= chips - 1){
+            distance ++ ;
+          }
+          if(nibble != 0xFF && distance < best_distance){
+            best_distance = distance ;
+            candidates[i] = 0 ;
+          }
+          if(nibble != 0xFF && distance == best_distance){
+            candidates[i] |= 1 << nibble ;
+          }
+        }
+      }
+    }
+    if(!valid && guess){
+      // Several nibbles are as near, so the byte that is a Hamming code with the fewest corrections is taken.
+      unsigned char best_quality = 3 ;
+      for(unsigned char high = 0 ; high < 16 ; high ++){
+        for(unsigned char low = 0 ; low < 16 ; low ++){
+          if(!(candidates[0] & (1 << high)) || !(candidates[1] & (1 << low))){
+            continue ;
+          }
+          unsigned char nibble = pgm_read_byte(&hamming_decode_table[(high << 4) | low]);
+          unsigned char quality = (nibble == 0xFF) ? 2 : ((nibble & 0x10) ? 1 : 0) ;
+          if(quality < best_quality){
+            best_quality = quality ;
+            nibbles[0] = high ;
+            nibbles[1] = low ;
+          }
+        }
+      }
+    }
+  }else{
+    // Each byte of chips is decoded in a nibble. The least significant byte of chips holds the most significant nibble.
+    for(int i = 0 ; i < 2 ; i ++){
+      unsigned char chips = (character >> (i ? 8 : 0)) & 0xFF ;
+      nibbles[i] = pgm_read_byte(&manchester_decode_table[chips]);
+      if(nibbles[i] == 0xFF){
+        valid = false ;
+        if(guess){
+          // The first chip of each pair is the bit of a valid pair, and either chip of an invalid pair may be the wrong one.
+          nibbles[i] = ((chips & 0x01) << 3) | ((chips & 0x04) << 0) | ((chips & 0x10) >> 3) | ((chips & 0x40) >> 6) ;
+        }
+      }
+    }
+  }
+  if(!valid){
+    error_stats.invalid_codes ++ ;
+    if(!guess){
+      return -1 ;
+    }
+  }
+  return (nibbles[0] << 4) | nibbles[1] ;
+}
+
+int VLC::set_line_code(enum vlc_line_code line_code){
+  if((line_code != VLC_LINE_CODE_MANCHESTER && line_code != VLC_LINE_CODE_4B6B) || tx_running){
+    return -1 ;
   }
-  (*data_manchester) |= 0x01 ; //START symbol
+  this->line_code = line_code ;
+  word_length = (line_code == VLC_LINE_CODE_4B6B) ? WORD_LENGTH_4B6B : WORD_LENGTH * 2 ;
+  return 0 ;
 }
 
 void VLC::int_frame(char * frame){
-  memset(frame, 0xAA, 3);
-  frame[3] = SYNCHRONIZE_SYMBOL ;
-  frame[4] = START_FLAG;
-  frame_index = -1 ;
-  frame_size = -1 ;
+  memset(frame, 0xAA, PREAMBLE_SIZE - 1);
+  frame[PREAMBLE_SIZE - 1] = SYNCHRONIZE_SYMBOL ;
+  frame[PREAMBLE_SIZE] = START_FLAG;
 }
 
 void VLC::int_emitter(){
   manchester_data = 0xFFFFFFFF ;
-  bit_counter = WORD_LENGTH * 2 ;
+  bit_counter = word_length ;
+  frame_index = -1 ;
+  frame_size = -1 ;
+  tx_head = 0 ;
+  tx_tail = 0 ;
+  tx_running = false ;
+  tx_streaming = false ;
+  tx_message_streaming = false ;
+}
+
+inline int VLC::fragment_header_size(){
+  return (tx_message != NULL && frame_format == VLC_FRAME_LENGTH) ? VLC_FRAGMENT_HEADER_SIZE : 0 ;
+}
+
+inline int VLC::expected_fragments(){
+  if(reassembly.count != VLC_FRAGMENT_COUNT_UNKNOWN){
+    return reassembly.count ;
+  }
+  return (reassembly.received_count > 0) ? reassembly.last_index + 2 : 0 ;
 }
 
 int VLC::create_frame(char * data, int data_size){
-  write_data_frame(data, data_size, frame_buffer);
+  // It is checked that the data fits in the frame and that there is a free slot in the queue.
+  if(data_size + fragment_header_size() > VLC_MAX_PAYLOAD || VLC_tx_free_slots() == 0){
+    return -1 ;
+  }
+  struct vlc_tx_slot * slot = &(tx_queue[tx_head % VLC_TX_QUEUE_SLOTS]);
+  slot->continuation = is_continuation();
+  slot->size = describe_frame(data, data_size, slot->continuation, &(slot->frame));
+  slot->fec = (frame_format == VLC_FRAME_LENGTH) && (frame_options & VLC_OPTION_FEC) ;
+  #if VLC_PRECODED_FRAME == 1
+    slot->encoded = false ;
+  #endif
+  return queue_frame();
+}
+
+#if VLC_PRECODED_FRAME == 1
+int VLC::create_encoded_frame(char * data, int data_size){
+  // It is checked that the data fits in the frame and that there is a free slot in the queue.
+  if(data_size + fragment_header_size() > VLC_MAX_PAYLOAD || VLC_tx_free_slots() == 0){
+    return -1 ;
+  }
+  bool fec = (frame_format == VLC_FRAME_LENGTH) && (frame_options & VLC_OPTION_FEC) ;
+  int size = PREAMBLE_SIZE + 2 + fragment_header_size() + data_size + ((frame_options & VLC_OPTION_CRC) ? VLC_CRC_SIZE : 0) ;
+  // With FEC each byte after the flag takes two words.
+  if(fec && (2 * size - PREAMBLE_SIZE - 1) > FRAME_MAX){
+    return -1 ;
+  }
+  struct vlc_tx_slot * slot = &(tx_queue[tx_head % VLC_TX_QUEUE_SLOTS]);
+  slot->continuation = is_continuation();
+  size = write_frame(data, data_size, slot->continuation, frame_buffer);
+  // The whole frame is encoded so that the interrupt only loads each word.
+  int word_index = 0 ;
+  for(int i = 0 ; i < size ; i ++){
+    if(i == PREAMBLE_SIZE - 1){
+      sync_to_word(&(slot->words[word_index++]));
+    }else if(fec && i > PREAMBLE_SIZE){
+      encode_data(pgm_read_byte(&hamming_encode_table[(unsigned char)frame_buffer[i] >> 4]), &(slot->words[word_index++]));
+      encode_data(pgm_read_byte(&hamming_encode_table[frame_buffer[i] & 0x0F]), &(slot->words[word_index++]));
+    }else{
+      encode_data(frame_buffer[i], &(slot->words[word_index++]));
+    }
+  }
+  slot->size = word_index ;
+  slot->fec = false ;
+  slot->encoded = true ;
+  return queue_frame();
+}
+#endif
+
+int VLC::write_frame(char * data, int data_size, bool continuation, char * frame){
+  struct vlc_frame_descriptor descriptor ;
+  describe_frame(data, data_size, continuation, &descriptor);
+  return gather_frame(&descriptor, frame);
+}
+
+int VLC::describe_frame(char * data, int data_size, bool continuation, struct vlc_frame_descriptor * descriptor){
+  int_frame(descriptor->header);
+  descriptor->payload = data ;
+  descriptor->payload_size = (unsigned char)data_size ;
+  if(frame_format == VLC_FRAME_LENGTH){
+    // The size of the data follows the flag, so the data can contain any byte. The options of the frame are marked in the flag.
+    unsigned char options = frame_options ;
+    descriptor->header_size = PREAMBLE_SIZE + 2 ;
+    if(tx_message != NULL){
+      // The fragment header is sent as the first bytes of the data, from the descriptor, so the fragment is still read from the message.
+      options |= VLC_OPTION_FRAGMENT ;
+      descriptor->header[PREAMBLE_SIZE+2] = tx_message->message_id ;
+      descriptor->header[PREAMBLE_SIZE+3] = tx_message->fragment_index ;
+      descriptor->header[PREAMBLE_SIZE+4] = tx_message->fragment_count ;
+      descriptor->header[PREAMBLE_SIZE+5] = tx_message->fragment_size ;
+      descriptor->header_size += VLC_FRAGMENT_HEADER_SIZE ;
+    }
+    descriptor->header[PREAMBLE_SIZE] = (continuation ? LENGTH_FRAGMENT_FLAG : LENGTH_FLAG) | options ;
+    descriptor->header[PREAMBLE_SIZE+1] = (unsigned char)(data_size + descriptor->header_size - PREAMBLE_SIZE - 2) ;
+    descriptor->trailer_size = 0 ;
+    if(frame_options & VLC_OPTION_CRC){
+      // The CRC-16 of the size, the fragment header and the data is added at the end, most significant byte first.
+      unsigned int crc = frame_crc(&(descriptor->header[PREAMBLE_SIZE+1]), descriptor->header_size - PREAMBLE_SIZE - 1, data, data_size);
+      descriptor->trailer[0] = crc >> 8 ;
+      descriptor->trailer[1] = crc & 0xFF ;
+      descriptor->trailer_size = VLC_CRC_SIZE ;
+    }
+  }else{
+    descriptor->header[PREAMBLE_SIZE] = continuation ? FRAGMENT_FLAG : START_FLAG ;
+    descriptor->header_size = PREAMBLE_SIZE + 1 ;
+    descriptor->trailer[0] = END_FLAG ;
+    descriptor->trailer_size = 1 ;
+  }
+  return descriptor->header_size + data_size + descriptor->trailer_size ;
+}
+
+int VLC::gather_frame(struct vlc_frame_descriptor * descriptor, char * frame){
+  memcpy(frame, descriptor->header, descriptor->header_size);
+  memcpy(&(frame[descriptor->header_size]), descriptor->payload, descriptor->payload_size);
+  memcpy(&(frame[descriptor->header_size + descriptor->payload_size]), descriptor->trailer, descriptor->trailer_size);
+  return descriptor->header_size + descriptor->payload_size + descriptor->trailer_size ;
+}
+
+inline unsigned char VLC::frame_byte(struct vlc_frame_descriptor * descriptor, int index){
+  // The parts of the frame are read in place, so the data is never copied.
+  if(index < descriptor->header_size){
+    return descriptor->header[index] ;
+  }
+  index -= descriptor->header_size ;
+  if(index < descriptor->payload_size){
+    return descriptor->payload[index] ;
+  }
+  return descriptor->trailer[index - descriptor->payload_size] ;
+}
+
+unsigned int VLC::frame_crc(const char * header, int header_size, const char * data, int size){
+  // CRC-16/CCITT-FALSE: polynomial 0x1021 and initial value 0xFFFF.
+  unsigned int crc = 0xFFFF ;
+  for(int i = 0 ; i < header_size ; i ++){
+    crc = _crc_xmodem_update(crc, header[i]);
+  }
+  for(int i = 0 ; i < size ; i ++){
+    crc = _crc_xmodem_update(crc, data[i]);
+  }
+  return crc ;
+}
+
+int VLC::set_frame_options(unsigned char frame_options){
+  if(frame_options & ~(VLC_OPTION_CRC | VLC_OPTION_FEC)){
+    return -1 ;
+  }
+  this->frame_options = frame_options ;
+  return 0 ;
+}
+
+struct vlc_error_stats VLC::get_error_stats(){
+  return error_stats ;
+}
+
+#if VLC_ISR_STATS == 1
+void VLC::record_isr(unsigned int entry_ticks, unsigned int exit_ticks, bool overrun){
+  // If a compare match arrived during the interrupt, the timer has been cleared once more.
+  if(exit_ticks < entry_ticks){
+    exit_ticks += OCR3A + 1 ;
+  }
+  unsigned int cycles = (exit_ticks - entry_ticks) << isr_prescaler_shift ;
+  unsigned int latency = entry_ticks << isr_prescaler_shift ;
+  if(cycles < isr_stats.min_cycles){
+    isr_stats.min_cycles = cycles ;
+  }
+  if(cycles > isr_stats.max_cycles){
+    isr_stats.max_cycles = cycles ;
+  }
+  isr_stats.total_cycles += cycles ;
+  isr_stats.count ++ ;
+  if(overrun){
+    isr_stats.overruns ++ ;
+  }
+  latency /= VLC_ISR_JITTER_BIN_CYCLES ;
+  isr_stats.jitter[latency < VLC_ISR_JITTER_BINS ? latency : VLC_ISR_JITTER_BINS - 1] ++ ;
+}
+
+struct vlc_isr_stats VLC::get_isr_stats(){
+  struct vlc_isr_stats stats ;
   ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
-    frame_index = 0 ;
-    frame_size = data_size + 6 ;
+    stats = isr_stats ;
+  }
+  return stats ;
+}
+
+void VLC::reset_isr_stats(){
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+    memset(&isr_stats, 0, sizeof(isr_stats));
+    isr_stats.min_cycles = 0xFFFF ;
+  }
+}
+
+void VLC::print_isr_stats(){
+  struct vlc_isr_stats stats = get_isr_stats();
+  USB.print(F("ISR count: "));
+  USB.println(stats.count);
+  if(stats.count == 0){
+    return ;
+  }
+  USB.print(F("ISR cycles min/avg/max: "));
+  USB.print(stats.min_cycles);
+  USB.print(F("/"));
+  USB.print(stats.total_cycles / stats.count);
+  USB.print(F("/"));
+  USB.println(stats.max_cycles);
+  USB.print(F("ISR overruns: "));
+  USB.println(stats.overruns);
+  USB.println(F("ISR latency histogram (cycles: count):"));
+  for(int i = 0 ; i < VLC_ISR_JITTER_BINS ; i ++){
+    USB.print(i * VLC_ISR_JITTER_BIN_CYCLES);
+    if(i == VLC_ISR_JITTER_BINS - 1){
+      USB.print(F("+"));
+    }
+    USB.print(F(": "));
+    USB.println(stats.jitter[i]);
   }
+}
+#endif
+
+int VLC::set_frame_format(enum vlc_frame_format frame_format){
+  if(frame_format != VLC_FRAME_END_FLAG && frame_format != VLC_FRAME_LENGTH){
+    return -1 ;
+  }
+  this->frame_format = frame_format ;
   return 0 ;
 }
 
+bool VLC::is_continuation(){
+  // The fragments of a streamed message after the first one are linked to the previous frame, whichever it is.
+  if(tx_message != NULL && tx_message->streamed){
+    return tx_message->fragment_index > 0 ;
+  }
+  // Every frame of a stream except the first one is sent as a fragment linked to the previous frame.
+  bool continuation = tx_streaming && !tx_stream_first ;
+  tx_stream_first = false ;
+  return continuation ;
+}
+
+int VLC::queue_frame(){
+  int ticket = tx_head ;
+  bool start = false ;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+    tx_head ++ ;
+    start = !tx_running ;
+    tx_running = true ;
+  }
+  // If the emission was stopped, it is started again.
+  if(start){
+    start_emission();
+  }
+  return ticket ;
+}
+
+int VLC::VLC_tx_free_slots(){
+  return VLC_TX_QUEUE_SLOTS - (unsigned char)(tx_head - tx_tail);
+}
+
+enum vlc_tx_status VLC::VLC_send_status(int ticket){
+  unsigned char head, tail ;
+  int index ;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+    head = tx_head ;
+    tail = tx_tail ;
+    index = frame_index ;
+  }
+  // The frames between the tail and the head of the queue have not been emitted yet.
+  if((unsigned char)(ticket - tail) < (unsigned char)(head - tail)){
+    if(ticket == tail && index >= 0){
+      return VLC_TX_SENDING ;
+    }
+    return VLC_TX_QUEUED ;
+  }
+  return VLC_TX_DONE ;
+}
+
+void VLC::VLC_stream_begin(){
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+    tx_streaming = true ;
+    tx_stream_first = true ;
+  }
+}
+
+void VLC::VLC_stream_end(){
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+    tx_streaming = false ;
+    // If the queue was drained while the stream was open, the timer is stopped here and the lamp is turned on.
+    if(tx_running && !tx_message_streaming && tx_tail == tx_head && frame_index < 0){
+      stop_emission();
+    }
+  }
+}
+
+void VLC::set_tx_callback(void (*callback)(int ticket)){
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+    tx_callback = callback ;
+  }
+}
+
 void VLC::write_data_frame(char * data, int data_size, char * frame){
-  memcpy(&(frame[5]), data, data_size);
-  frame[5+data_size] = END_FLAG;
+  memcpy(&(frame[PREAMBLE_SIZE+1]), data, data_size);
+  frame[PREAMBLE_SIZE+1+data_size] = END_FLAG;
 }
 
 void VLC::init_VLC_emitter(){
-  // Initialization frame.
-  int_frame(frame_buffer);
   // Initialization emitter variables.
   int_emitter();
 }
 
 void VLC::send_VLC(char * msg, int msg_size, int fragment_size){
+  if(send_VLC_begin(msg, msg_size, fragment_size) < 0){
+    return ;
+  }
+
+  // The fragments are read from the message during the emission, so it waits until the last one has been emitted.
+  while(send_VLC_poll()){
+    delay(10);
+  }
+}
+
+int VLC::send_VLC_begin(char * msg, int msg_size, int fragment_size){
   // Variable Inicialization.
   vlc_sending = true;
-  if(fragment_size>0){
-    vlc_size_send = msg_size;  
-  }else{
-    vlc_size_send = 0;
+  vlc_msg_send = msg;
+  vlc_ticket = -1;
+  vlc_size_send = msg_size;
+
+  // In frames with length each fragment carries its position in the message, so the receiver can place it and detect the lost ones.
+  if(fragment_size > 0 && frame_format == VLC_FRAME_LENGTH){
+    if(fragment_size > VLC_MAX_PAYLOAD - VLC_FRAGMENT_HEADER_SIZE){
+      fragment_size = VLC_MAX_PAYLOAD - VLC_FRAGMENT_HEADER_SIZE ;
+    }
+    int count = (msg_size + fragment_size - 1) / fragment_size ;
+    if(count > VLC_MAX_FRAGMENTS){
+      #if DEBUG_VLC == 1
+        USB.println(F("Too many fragments"));
+      #endif
+      vlc_sending = false;
+      return -1 ;
+    }
+    tx_message_id ++ ;
+    vlc_message.message_id = tx_message_id ;
+    vlc_message.fragment_count = (count > 0) ? count : 1 ;
+    vlc_message.fragment_size = fragment_size ;
   }
-  
+  vlc_fragment_send = fragment_size;
+  vlc_message.fragment_index = 0 ;
+
+  // The fragments of the message are streamed one after another without stopping the timer. Only they are linked, so other frames can be queued between them.
+  vlc_message.streamed = (fragment_size > 0 && msg_size > fragment_size) ;
+  if(vlc_message.streamed){
+    tx_message_streaming = true ;
+  }
+  return 0 ;
+}
 
-  // The sending function is called 
-  while(vlc_sending){
-    if(fragment_size == 0){
-      VLC_send(msg, msg_size);
+bool VLC::send_VLC_poll(){
+  // The fragments are queued while there are free slots, so it never waits for the emission. Without fragment size the message is a whole frame.
+  struct vlc_tx_message * message = (vlc_fragment_send > 0) ? &vlc_message : NULL ;
+  while(vlc_sending && VLC_tx_free_slots() > 0){
+    if(vlc_fragment_send == 0){
+      vlc_ticket = queue_message_frame(message, vlc_msg_send, vlc_size_send);
       vlc_sending = false;
       #if DEBUG_VLC == 1
         USB.print("Data 1: ");
-        USB.println(msg);
+        USB.println(vlc_msg_send);
       #endif
-    }else if(vlc_size_send <= fragment_size){
-      VLC_send(msg, vlc_size_send);
+    }else if(vlc_size_send <= vlc_fragment_send){
+      vlc_ticket = queue_message_frame(message, vlc_msg_send, vlc_size_send);
       vlc_sending = false;
       #if DEBUG_VLC == 1
         USB.print("Data 2: ");
-        USB.println(msg);
+        USB.println(vlc_msg_send);
       #endif
-    }else if(vlc_size_send > fragment_size){
-      VLC_send(msg, fragment_size);
+    }else if(vlc_size_send > vlc_fragment_send){
+      vlc_ticket = queue_message_frame(message, vlc_msg_send, vlc_fragment_send);
       vlc_sending = true;
       #if DEBUG_VLC == 1
         USB.print("Data 3: ");
-        for(int i=0; i<fragment_size; i++){
-          USB.print(msg[i]);  
+        for(int i=0; i<vlc_fragment_send; i++){
+          USB.print(vlc_msg_send[i]);  
         }      
         USB.println();
       #endif
-      vlc_size_send -= fragment_size;
-      msg = msg + fragment_size;
+      vlc_size_send -= vlc_fragment_send;
+      vlc_msg_send = vlc_msg_send + vlc_fragment_send;
+    }
+
+    if(!vlc_sending){
+      end_message_stream();
     }
   }
 
+  return vlc_sending || (vlc_ticket >= 0 && VLC_send_status(vlc_ticket) != VLC_TX_DONE);
+}
+
+int VLC::queue_message_frame(struct vlc_tx_message * message, char * data, int data_size){
+  // The message is only attached to the frame while it is queued.
+  tx_message = message ;
+  int ticket = VLC_queue(data, data_size);
+  tx_message = NULL ;
+  if(ticket >= 0 && message != NULL){
+    message->fragment_index ++ ;
+  }
+  return ticket ;
+}
+
+void VLC::end_message_stream(){
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+    tx_message_streaming = false ;
+    // If the queue was drained before the last fragment was queued, the timer is stopped here and the lamp is turned on.
+    if(tx_running && !tx_streaming && tx_tail == tx_head && frame_index < 0){
+      stop_emission();
+    }
+  }
 }
 
+#if DEBUG_VLC == 1
+void VLC::benchmark_streaming(int msg_size, int fragment_size){
+  char fragment [VLC_MAX_PAYLOAD] ;
+  unsigned long start_time ;
+  unsigned long frames_time ;
+  unsigned long stream_time ;
+  int ticket = -1 ;
+  if(fragment_size > VLC_MAX_PAYLOAD){
+    fragment_size = VLC_MAX_PAYLOAD ;
+  }
+  if(fragment_size < 1){
+    fragment_size = 1 ;
+  }
+  memset(fragment, '5', fragment_size);
+  // At least one fragment is sent, so a message shorter than a fragment is measured too.
+  int fragments = msg_size / fragment_size ;
+  if(fragments < 1){
+    fragments = 1 ;
+  }
+
+  // Each fragment is sent as an independent frame, with its preamble and the start and stop of the timer.
+  start_time = millis();
+  for(int i = 0 ; i < fragments ; i ++){
+    VLC_send(fragment, fragment_size);
+  }
+  frames_time = millis() - start_time ;
+
+  // The fragments are streamed without stopping the timer and without preamble.
+  start_time = millis();
+  VLC_stream_begin();
+  for(int i = 0 ; i < fragments ; i ++){
+    ticket = VLC_queue(fragment, fragment_size);
+  }
+  VLC_stream_end();
+  while(ticket >= 0 && VLC_send_status(ticket) != VLC_TX_DONE){
+    delay(1);
+  }
+  stream_time = millis() - start_time ;
+
+  USB.print(F("Payload (bytes): "));
+  USB.println(fragments * fragment_size);
+  // A transfer shorter than the resolution of millis() is counted as 1 ms.
+  if(frames_time == 0){
+    frames_time = 1 ;
+  }
+  if(stream_time == 0){
+    stream_time = 1 ;
+  }
+  USB.print(F("Frames goodput (bytes/s): "));
+  USB.println((unsigned long)fragments * fragment_size * 1000 / frames_time);
+  USB.print(F("Stream goodput (bytes/s): "));
+  USB.println((unsigned long)fragments * fragment_size * 1000 / stream_time);
+  USB.print(F("Gain (%): "));
+  USB.println((long)(frames_time - stream_time) * 100 / (long)stream_time);
+}
+
+void VLC::benchmark_error_correction(unsigned long ber_ppm, int frames, int payload_size){
+  static const unsigned char options [3] = {0, VLC_OPTION_CRC, VLC_OPTION_CRC | VLC_OPTION_FEC} ;
+  char payload [VLC_MAX_PAYLOAD] ;
+  char frame [FRAME_MAX] ;
+  enum vlc_frame_format saved_format = frame_format ;
+  unsigned char saved_options = frame_options ;
+  if(payload_size > VLC_MAX_PAYLOAD){
+    payload_size = VLC_MAX_PAYLOAD ;
+  }
+  frame_format = VLC_FRAME_LENGTH ;
+  // The half bits per second of the selected frequency are obtained from its Timer3 configuration.
+  unsigned long half_bit_rate = (unsigned long)(BOARD_FREQUENCY / ((unsigned long)(pgm_read_word(&(vlc_rate_profiles[rate].emitter_compare)) + 1) << pgm_read_byte(&(vlc_rate_profiles[rate].prescaler_shift))));
+
+  for(int mode = 0 ; mode < 3 ; mode ++){
+    unsigned int received = 0 ;
+    unsigned int discarded = 0 ;
+    unsigned int corrupted = 0 ;
+    unsigned int corrected = error_stats.fec_corrected ;
+    unsigned int invalid = error_stats.invalid_codes ;
+    bool fec = options[mode] & VLC_OPTION_FEC ;
+    frame_options = options[mode] ;
+
+    for(int n = 0 ; n < frames ; n ++){
+      for(int i = 0 ; i < payload_size ; i ++){
+        payload[i] = rand() ;
+      }
+      int size = write_frame(payload, payload_size, false, frame);
+
+      // The frame is received from the synchronization symbol, flipping each chip sent after it with the given probability.
+      enum receiver_state state = WAITING_SYNCHRONIZE ;
+      int index = -1 ;
+      int received_size = -1 ;
+      int result = add_byte_to_buffer(frame_buffer, &index, &received_size, &state, SYNCHRONIZE_SYMBOL);
+      for(int i = PREAMBLE_SIZE ; i < size && result == 0 ; i ++){
+        bool fec_data = fec && i > PREAMBLE_SIZE ;
+        for(int half = 0 ; half < (fec_data ? 2 : 1) && result == 0 ; half ++){
+          unsigned char data = frame[i] ;
+          if(fec_data){
+            data = pgm_read_byte(&hamming_encode_table[half ? (data & 0x0F) : ((unsigned char)frame[i] >> 4)]);
+          }
+          unsigned long int word ;
+          encode_data(data, &word);
+          // The chips are shifted in as the receiver does, so the first chip sent ends in the most significant bit.
+          unsigned long int chips = 0 ;
+          for(int chip = 0 ; chip < word_length ; chip ++){
+            unsigned long int value = (word >> chip) & 0x01 ;
+            if(((((unsigned long)rand() << 15) | rand()) % 1000000UL) < ber_ppm){
+              value ^= 0x01 ;
+            }
+            chips = (chips << 1) | value ;
+          }
+          int decoded ;
+          if(line_code == VLC_LINE_CODE_4B6B){
+            decoded = decode_character(chips & 0xFFF, fec_data);
+          }else if((chips & START_STOP_MASK & 0xFFFFF) != (START_STOP_MASK & 0xFFFFF)){
+            decoded = -1 ; // A wrong start or stop chip loses the synchronization of the receiver, and with it the frame.
+          }else{
+            decoded = decode_character((chips >> 2) & 0xFFFF, fec_data);
+          }
+          result = (decoded < 0) ? -1 : add_byte_to_buffer(frame_buffer, &index, &received_size, &state, decoded);
+        }
+      }
+      if(result == 1 && memcmp(&(frame_buffer[1]), payload, payload_size) == 0){
+        received ++ ;
+      }else if(result == 1){
+        corrupted ++ ;
+      }else{
+        discarded ++ ;
+      }
+    }
+
+    // Words on air of each frame: preamble, flag, and size, data and CRC, doubled with FEC.
+    unsigned long words = PREAMBLE_SIZE + 1 + (fec ? 2 : 1) * (1 + payload_size + ((options[mode] & VLC_OPTION_CRC) ? VLC_CRC_SIZE : 0)) ;
+    USB.print(F("Options: "));
+    USB.println(options[mode], HEX);
+    USB.print(F("Received: "));
+    USB.println(received);
+    USB.print(F("Discarded: "));
+    USB.println(discarded);
+    USB.print(F("Accepted with errors: "));
+    USB.println(corrupted);
+    USB.print(F("Corrected codes: "));
+    USB.println(error_stats.fec_corrected - corrected);
+    USB.print(F("Invalid codes: "));
+    USB.println(error_stats.invalid_codes - invalid);
+    USB.print(F("Goodput (bytes/s): "));
+    USB.println((half_bit_rate / word_length) * received * payload_size / ((unsigned long)frames * words));
+  }
+
+  frame_format = saved_format ;
+  frame_options = saved_options ;
+  rx_payload_length = -1 ;
+}
+#endif
+
 
 void VLC::VLC_send(char * msg, int msg_size){
-  // Timer is started.
-  start_timer();
-  memcpy(message_buffer, msg, msg_size);
-  create_frame(message_buffer, msg_size);
-  while(frame_index != -1){
+  int ticket = VLC_queue(msg, msg_size);
+  if(ticket < 0){
+    return ;
+  }
+  // It waits until the frame has been emitted. The timer is stopped and the lamp turned on by the interrupt when the queue is empty.
+  while(VLC_send_status(ticket) != VLC_TX_DONE){
     delay(10);
   }
-  // The timer is stopped.
-  stop_timer();
-  // The lamp is turned on.
-  PIN_ON();
+}
+
+int VLC::VLC_queue(char * msg, int msg_size){
+  if(msg_size > VLC_MAX_PAYLOAD){
+    return -1 ;
+  }
+  // It waits until there is a free slot in the transmit queue.
+  while(VLC_tx_free_slots() == 0){
+    delay(10);
+  }
+  return VLC_send_async(msg, msg_size);
+}
+
+int VLC::VLC_send_async(char * msg, int msg_size){
+  #if VLC_PRECODED_FRAME == 1
+    return create_encoded_frame(msg, msg_size);
+  #else
+    return create_frame(msg, msg_size);
+  #endif
 }
 
 void VLC::init_VLC_receptor(){
@@ -218,7 +1055,22 @@ void VLC::init_VLC_receptor(){
 void VLC::init_variables(){
   frame_index = -1; 
   frame_size = -1; 
-  new_character = 0;
+  rx_payload_length = -1;
+  rx_options = 0;
+  rx_fec_half = false;
+  error_stats.crc_errors = 0;
+  error_stats.fec_corrected = 0;
+  error_stats.fec_uncorrectable = 0;
+  error_stats.invalid_codes = 0;
+  rx_synchronized = false;
+  rx_chip_period = NUMBER_OF_SAMPLES * VLC_PLL_SCALE * VLC_PLL_GAIN;
+  rx_phase = 0;
+  rx_ring_head = 0;
+  rx_ring_tail = 0;
+  rx_overruns = 0;
+  rx_overruns_seen = 0;
+  memset(&reassembly, 0, sizeof(reassembly));
+  memset(&reassembly_stats, 0, sizeof(reassembly_stats));
   detected_character = 0;
   old_read_value = 0;
   old_value = 0;
@@ -229,11 +1081,17 @@ void VLC::init_variables(){
   new_character_insert = 0;
   sync_character_detect = 0;
   receiving = true;
+  rx_running = false;
 }
 
 void VLC::init_ADC(){
-  // It setup the prescaler of 128.
-  ADCSRA |= (1<<ADPS0) | (1<<ADPS1) | (1<<ADPS2);
+  #if VLC_ADC_8BIT == 1
+    // It setup the prescaler of 16. The resolution is reduced above 200 kHz, so only 8 bits are read.
+    ADCSRA = (ADCSRA & ~((1<<ADPS0) | (1<<ADPS1) | (1<<ADPS2))) | (1<<ADPS2);
+  #else
+    // It setup the prescaler of 128.
+    ADCSRA |= (1<<ADPS0) | (1<<ADPS1) | (1<<ADPS2);
+  #endif
 
   // ADC reference voltage is set.
   #ifdef ADC_REF_1.1
@@ -251,6 +1109,11 @@ void VLC::init_ADC(){
   // The ADC channel relationship to the pin used in the reception is established.
   ADMUX |= (ANALOG_RECEPTION_PIN & 0x07) ;
 
+  #if VLC_ADC_8BIT == 1
+    // The result is left adjusted, so the 8 most significant bits are read from ADCH.
+    ADMUX |= (1<<ADLAR) ;
+  #endif
+
   // ADC is turned on.
   ADCSRA |= (1<<ADEN);
 }
@@ -263,21 +1126,138 @@ void VLC::start_ADC(){
 int VLC::read_ADC(){
   // It remains on hold until the ADC completes the conversion.
   while(bit_is_set(ADCSRA, ADSC));
-  return ADC ;
+  #if VLC_ADC_8BIT == 1
+    return ADCH ;
+  #else
+    return ADC ;
+  #endif
 }
 
+void VLC::start_sampling(){
+  #if VLC_RX_FRONTEND == VLC_RX_FRONTEND_ADC
+    unsigned char prescaler_bits = pgm_read_byte(&(vlc_rate_profiles[rate].prescaler_bits));
+    unsigned int comparator_value = pgm_read_word(&(vlc_rate_profiles[rate].receiver_compare));
+    cli();
+    // Timer1 compare B triggers each conversion and the ADC interrupt processes its result.
+    ADCSRB = (ADCSRB & ~((1<<ADTS0) | (1<<ADTS1) | (1<<ADTS2))) | (1<<ADTS2) | (1<<ADTS0) ;
+    ADCSRA |= (1<<ADATE) | (1<<ADIE) ;
+    // Timer1 counts in CTC mode up to OCR1A, with the same prescaler bits and compare value as Timer3.
+    TCCR1A = 0 ;
+    TCCR1B = 0 ;
+    TCNT1 = 0 ;
+    OCR1A = comparator_value ;
+    OCR1B = comparator_value ;
+    TIFR1 = (1 << OCF1B) ;
+    TCCR1B = (1 << WGM12) | prescaler_bits ;
+    sei();
+  #elif VLC_RX_FRONTEND == VLC_RX_FRONTEND_CAPTURE
+    unsigned char prescaler_bits = pgm_read_byte(&(vlc_rate_profiles[rate].prescaler_bits));
+    half_bit_ticks = pgm_read_word(&(vlc_rate_profiles[rate].emitter_compare)) + 1 ;
+    cli();
+    // The comparator compares the analog reception pin, through the multiplexer of the disabled ADC, with the internal 1.1v reference, and its output drives the input capture of Timer1.
+    ADCSRA &= ~(1 << ADEN) ;
+    ADCSRB |= (1 << ACME) ;
+    ACSR = (1 << ACBG) | (1 << ACIC) ;
+    // Timer1 counts freely. The first edge captured is the opposite of the current level of the comparator.
+    TCCR1A = 0 ;
+    TCCR1B = (1 << ICNC1) | prescaler_bits ;
+    if(!(ACSR & (1 << ACO))){
+      TCCR1B |= (1 << ICES1) ;
+    }
+    last_capture = TCNT1 ;
+    TIFR1 = (1 << ICF1) | (1 << TOV1) ;
+    TIMSK1 |= (1 << ICIE1) ;
+    sei();
+  #else
+    start_ADC();
+    start_timer();
+  #endif
+}
 
-void VLC::receive_VLC(char * data_received){
-  int actual_size = 0;
-  do{
-    VLC_receive();
-    memcpy(data_received+actual_size, frame_buffer+1, frame_size);
-    actual_size += strlen(data_received);
-  }while(conversions_object.char_to_uint8t(frame_buffer[3],frame_buffer[4]) & 0x80 );
-  
+void VLC::stop_sampling(){
+  #if VLC_RX_FRONTEND == VLC_RX_FRONTEND_ADC
+    cli();
+    TCCR1B = 0 ;
+    ADCSRA &= ~((1<<ADATE) | (1<<ADIE)) ;
+    sei();
+  #elif VLC_RX_FRONTEND == VLC_RX_FRONTEND_CAPTURE
+    cli();
+    TIMSK1 &= ~(1 << ICIE1) ;
+    TCCR1B = 0 ;
+    ACSR &= ~(1 << ACIC) ;
+    ADCSRB &= ~(1 << ACME) ;
+    sei();
+  #else
+    stop_timer();
+  #endif
 }
 
 int VLC::add_byte_to_buffer(char * frame_buffer, int * frame_index, int * frame_size, enum receiver_state * frame_state ,unsigned char data){
+  // With FEC each byte after the flag is received as two Hamming codes, most significant nibble first.
+  if((rx_options & VLC_OPTION_FEC) && rx_payload_length >= 0 && ((*frame_state) == LENGTH || (*frame_state) == RECEIVING)){
+    unsigned char nibble = pgm_read_byte(&hamming_decode_table[data]);
+    if(nibble == 0xFF){ // Two errors can not be corrected, so the frame is discarded.
+      error_stats.fec_uncorrectable ++ ;
+      (*frame_index) = -1 ;
+      (*frame_size) = -1 ;
+      (*frame_state) = WAITING_SYNCHRONIZE ;
+      return -1 ;
+    }
+    if(nibble & 0x10){
+      error_stats.fec_corrected ++ ;
+    }
+    if(!rx_fec_half){
+      rx_fec_byte = nibble << 4 ;
+      rx_fec_half = true ;
+      return 0 ;
+    }
+    data = rx_fec_byte | (nibble & 0x0F) ;
+    rx_fec_half = false ;
+  }
+  // In the data of a frame with length every byte is data, including the flags.
+  if(rx_payload_length >= 0 && (*frame_state) == RECEIVING){
+    frame_buffer[*frame_index] = data ;
+    (*frame_index) ++ ;
+    if((*frame_index) > rx_payload_length + ((rx_options & VLC_OPTION_CRC) ? VLC_CRC_SIZE : 0)){ // All the data of the frame has been received.
+      if(rx_options & VLC_OPTION_CRC){
+        char size_byte = (char)rx_payload_length ;
+        unsigned int crc = frame_crc(&size_byte, 1, &(frame_buffer[1]), rx_payload_length);
+        if(((unsigned char)frame_buffer[rx_payload_length+1] != (crc >> 8)) || ((unsigned char)frame_buffer[rx_payload_length+2] != (crc & 0xFF))){
+          error_stats.crc_errors ++ ;
+          (*frame_index) = -1 ;
+          (*frame_size) = -1 ;
+          (*frame_state) = END ;
+          return -1 ;
+        }
+      }
+      // The CRC is not part of the data of the frame.
+      (*frame_size) = rx_payload_length + 2 ;
+      (*frame_index) = -1 ;
+      (*frame_state) = END ;
+      return 1 ;
+    }
+    return 0 ;
+  }
+  if((*frame_state) == LENGTH){ // The size of the data of the frame has been received.
+    // Any size fits in the buffer when the maximum is the largest size that one byte can carry.
+    #if VLC_MAX_PAYLOAD < 255
+      if(data > VLC_MAX_PAYLOAD){
+        (*frame_index) = -1 ;
+        (*frame_size) = -1 ;
+        (*frame_state) = WAITING_SYNCHRONIZE ;
+        return -1 ;
+      }
+    #endif
+    rx_payload_length = data ;
+    (*frame_state) = RECEIVING ;
+    if(rx_payload_length == 0 && !(rx_options & VLC_OPTION_CRC)){
+      (*frame_size) = (*frame_index) + 1 ;
+      (*frame_index) = -1 ;
+      (*frame_state) = END ;
+      return 1 ;
+    }
+    return 0 ;
+  }
   // The synchronization flag has been received.
   if(data == SYNCHRONIZE_SYMBOL){
     (*frame_index) = 0 ;
@@ -285,18 +1265,35 @@ int VLC::add_byte_to_buffer(char * frame_buffer, int * frame_index, int * frame_
     (*frame_state) = SYNCHRONIZE ;
     return 0 ;
   }
+  if((*frame_state) == END){ // Only a streamed fragment can follow a received frame without a new synchronization.
+    if(data != FRAGMENT_FLAG && (data & ~VLC_OPTIONS) != LENGTH_FRAGMENT_FLAG){
+      (*frame_state) = WAITING_SYNCHRONIZE ;
+      return -1 ;
+    }
+    (*frame_index) = 0 ;
+    (*frame_size) = 0 ;
+    (*frame_state) = SYNCHRONIZE ;
+  }
   if((*frame_state) != WAITING_SYNCHRONIZE){ // Check that the synchronization symbol has been received
   frame_buffer[*frame_index] = data ;
   (*frame_index) ++ ;
-    if(data == START_FLAG){  // The flag of the beginning of the data has been received.
+    if((*frame_index) == 1 && (data == START_FLAG || data == FRAGMENT_FLAG)){  // The flag of the beginning of the data has been received.
+      rx_payload_length = -1 ;
+      rx_options = 0 ;
       (*frame_state) = START ;
        return 0 ;
+    }else if((*frame_index) == 1 && ((data & ~VLC_OPTIONS) == LENGTH_FLAG || (data & ~VLC_OPTIONS) == LENGTH_FRAGMENT_FLAG)){  // The flag of a frame with length has been received, the size of the data follows.
+      rx_payload_length = 0 ;
+      rx_options = data & VLC_OPTIONS ;
+      rx_fec_half = false ;
+      (*frame_state) = LENGTH ;
+       return 0 ;
     }else if(data == END_FLAG){ // The end of data flag has been received.
       (*frame_size) = (*frame_index) ;
       (*frame_index) = -1 ;
-      (*frame_state) = WAITING_SYNCHRONIZE ;
+      (*frame_state) = END ;
        return 1 ;
-    }else if((*frame_index) >= 56){ // It is checked that the maximum that the frame can occupy is not exceeded.
+    }else if((*frame_index) >= FRAME_MAX){ // It is checked that the maximum that the frame can occupy is not exceeded.
       (*frame_index) = -1 ;
       (*frame_size) = -1 ;
       (*frame_state) = WAITING_SYNCHRONIZE ;
@@ -311,8 +1308,42 @@ int VLC::add_byte_to_buffer(char * frame_buffer, int * frame_index, int * frame_
 
 void VLC::sample_data(){
   // The value of the analog input pin is read and the ADC is activated again for the next conversion.
-  read_value  = read_ADC();
+  int value = read_ADC();
   start_ADC();
+  process_sample(value);
+}
+
+#if VLC_RX_FRONTEND == VLC_RX_FRONTEND_CAPTURE
+void VLC::capture_edge(unsigned int timestamp){
+  // The output of the comparator is high when the received voltage is below the reference, so a rising edge means that the lamp has turned off.
+  char value = (TCCR1B & (1 << ICES1)) ? -1 : 1 ;
+  // The next capture waits for the opposite edge.
+  TCCR1B ^= (1 << ICES1) ;
+  TIFR1 = (1 << ICF1) ;
+
+  // If the timer overflowed and did not wrap back below the previous capture, the signal was steady for longer than the timer range.
+  unsigned int interval = timestamp - last_capture ;
+  if((TIFR1 & (1 << TOV1)) && timestamp >= last_capture){
+    interval = 0xFFFF ;
+  }
+  TIFR1 = (1 << TOV1) ;
+  last_capture = timestamp ;
+
+  // The time is converted to the samples that the ADC front end would have counted, so the same decoder is used. It is kept in fractions of a sample, which the PLL uses to follow the clock of the emitter.
+  unsigned long samples = ((unsigned long)interval * NUMBER_OF_SAMPLES * VLC_PLL_SCALE + half_bit_ticks / 2) / half_bit_ticks ;
+  if(samples > (8 * NUMBER_OF_SAMPLES * VLC_PLL_SCALE)){
+    samples = 8 * NUMBER_OF_SAMPLES * VLC_PLL_SCALE ;
+  }
+  int event = insert_character(value, (int)samples, &(dist_last_sync), &detected_character);
+  rx_push(event, detected_character);
+  if(dist_last_sync > (8 * NUMBER_OF_SAMPLES)){ // The variable dist_last_sync is limited to avoid overflow problems
+    dist_last_sync = 32 ;
+  }
+}
+#endif
+
+void VLC::process_sample(int value){
+  read_value = value ;
 
   // The current and previous values read from the analog pin are checked to verify the value obtained.
   if((read_value - old_read_value) > DIFFERENCE_THRESHOLD){
@@ -327,12 +1358,13 @@ void VLC::sample_data(){
   old_read_value = read_value;
 
   // It is checked that the new and old values are different and that the minimum established samples have been taken to determine the arrival of a new character.
-  if(current_value == 0 || current_value == old_value || (current_value != old_value && value_counter < 2)){
-    if( value_counter < (4 * NUMBER_OF_SAMPLES)){
+  if(current_value == 0 || current_value == old_value || (current_value != old_value && value_counter < NUMBER_OF_SAMPLES / 2)){
+    if( value_counter < (8 * NUMBER_OF_SAMPLES)){
       value_counter ++ ;
     }
   }else{  
-      new_character = insert_character(current_value, value_counter, &(dist_last_sync), &detected_character); 
+      int event = insert_character(current_value, (value_counter + 1) * VLC_PLL_SCALE, &(dist_last_sync), &detected_character);
+      rx_push(event, detected_character);
       if(dist_last_sync > (8 * NUMBER_OF_SAMPLES)){ // The variable dist_last_sync is limited to avoid overflow problems
         dist_last_sync = 32 ;
       }
@@ -348,7 +1380,39 @@ inline int VLC::insert_character(char current_value, int value_period, int * tim
    is_a_character_value = 0;
    sync_character_detect = 0;
    if( (manchester_character & 0x01) != current_value ){ // It checked that it is not the same value.
-         if(value_period > (NUMBER_OF_SAMPLES+1)){
+         // Number of chips for which the signal was steady, limited to the longest run of the line code.
+         #if VLC_RX_PLL == 1
+         // The edges are only seen at the samples, so the phase error left by the previous edge is added to compensate the quantization.
+         int period = rx_chip_period / VLC_PLL_GAIN ;
+         value_period += rx_phase ;
+         #else
+         int period = NUMBER_OF_SAMPLES * VLC_PLL_SCALE ;
+         #endif
+         int run = (value_period + period / 2) / period ;
+         int max_run = (line_code == VLC_LINE_CODE_4B6B) ? MAX_RUN_4B6B : MAX_RUN_MANCHESTER ;
+         #if VLC_RX_PLL == 1
+         if(run >= 1 && run <= max_run){
+           // Loop filter: half of the phase error is carried to the next edge and the estimated half bit length moves 1/VLC_PLL_GAIN of the error of each half bit. The length is kept multiplied by the gain so that the small errors are not lost.
+           int phase_error = value_period - run * period ;
+           rx_phase = phase_error / 2 ;
+           int filter = rx_chip_period + phase_error / run ;
+           if(filter < (NUMBER_OF_SAMPLES * VLC_PLL_SCALE * VLC_PLL_GAIN * 3) / 4){
+             filter = (NUMBER_OF_SAMPLES * VLC_PLL_SCALE * VLC_PLL_GAIN * 3) / 4 ;
+           }else if(filter > (NUMBER_OF_SAMPLES * VLC_PLL_SCALE * VLC_PLL_GAIN * 5) / 4){
+             filter = (NUMBER_OF_SAMPLES * VLC_PLL_SCALE * VLC_PLL_GAIN * 5) / 4 ;
+           }
+           rx_chip_period = filter ;
+         }else{
+           // The idle periods longer than the longest run are not used, and the phase is taken again from the next edge.
+           rx_phase = 0 ;
+         }
+         #endif
+         if(run < 1){
+           run = 1 ;
+         }else if(run > max_run){
+           run = max_run ;
+         }
+         for( ; run > 1 ; run --){
             last_bit = manchester_character & 0x01 ;
             manchester_character = (manchester_character << 1) | last_bit ; // The signal was steady for longer than a single symbol. 
             (*time_from_last_sync) += 1 ;
@@ -357,6 +1421,7 @@ inline int VLC::insert_character(char current_value, int value_period, int * tim
                new_character_insert = 1 ;
               (*time_from_last_sync) =  0 ;
               if(is_a_character_value > 1){
+                 new_character_insert = 2 ;
                  sync_character_detect = 1 ; // It is detected framing and sync word in manchester format.
               }
             }
@@ -370,7 +1435,7 @@ inline int VLC::insert_character(char current_value, int value_period, int * tim
          (*time_from_last_sync) += 1 ;
          is_a_character_value = is_a_character((*time_from_last_sync), detected_character);
          if(sync_character_detect == 0 && is_a_character_value > 0){ // If sync flag was detected, it doesn't take character detection into account
-           new_character_insert = 1 ;
+           new_character_insert = is_a_character_value ;
            (*time_from_last_sync) =  0 ;
          }
       }else{
@@ -380,52 +1445,98 @@ inline int VLC::insert_character(char current_value, int value_period, int * tim
 }
 
 inline int VLC::is_a_character(int time_from_last_sync, unsigned int * detected_character){
-  if(time_from_last_sync >= 20  || frame_state == WAITING_SYNCHRONIZE){ 
+  if(line_code == VLC_LINE_CODE_4B6B){
+    // The synchronization word cannot appear in 4B6B data, so it realigns the receiver in any state.
+    if((manchester_character & 0xFFF) == SYNC_SYMBOL_4B6B){
+      (*detected_character) = SYNC_SYMBOL_4B6B ;
+      rx_synchronized = true ;
+      return 2 ;
+    }
+    if(rx_synchronized && time_from_last_sync >= WORD_LENGTH_4B6B){
+      // Once synchronized, every 12 chips form a character.
+      (*detected_character) = manchester_character & 0xFFF ;
+      return 1 ;
+    }
+    return 0 ;
+  }
+  if(!rx_synchronized && sync_errors() <= VLC_SYNC_MAX_ERRORS){
+    // The synchronization flag has arrived, although some of its chips may be wrong.
+    (*detected_character) = SYNC_SYMBOL_MANCHESTER ;
+    rx_synchronized = true ;
+    return 2 ;
+  }
+  if(time_from_last_sync >= 20  || !rx_synchronized){ 
       // It is checked that the specified data have the defined format.   
       if((manchester_character & START_STOP_MASK) == (START_STOP_MASK)){
             // The received character is stored.
             (*detected_character) = (manchester_character >> 2) & 0xFFFF;
-            if(frame_state == WAITING_SYNCHRONIZE){
-              // It is checked if the synchronization flag has arrived.
-               if((*detected_character) == SYNC_SYMBOL_MANCHESTER){
-                return 2 ;
-               }
-            }
             return 1 ;
       // If it has been synchronized and all the data that defines a character has been received, the received data is saved.
-      }else if(frame_state != WAITING_SYNCHRONIZE && time_from_last_sync == 20){
+      }else if(rx_synchronized && time_from_last_sync == 20){
          (*detected_character)= (manchester_character >> 2) & 0xFFFF;
+         // The start and stop bits are lost, so the synchronization symbol is searched again.
+         rx_synchronized = false ;
          return 1 ;
       }
     }
     return 0 ;
 }
 
-void VLC::VLC_receive(){
-  // The ADC conversion is started.
-  start_ADC();
+inline unsigned char VLC::sync_errors(){
+  unsigned long difference = (manchester_character ^ SYNC_CORRELATOR_WORD) & SYNC_CORRELATOR_MASK ;
+  unsigned char errors = 0 ;
+  // Each iteration clears the lowest different chip, and it stops once the word can not be accepted.
+  while(difference && errors <= VLC_SYNC_MAX_ERRORS){
+    difference &= difference - 1 ;
+    errors ++ ;
+  }
+  return errors ;
+}
 
-  // Timer is started.
-  start_timer();
+void VLC::rx_push(int event, unsigned int character){
+  if(event <= 0){
+    return ;
+  }
+  if((unsigned char)(rx_ring_head - rx_ring_tail) == VLC_RX_RING_SIZE){
+    rx_overruns ++ ;
+    return ;
+  }
+  rx_ring_characters[rx_ring_head % VLC_RX_RING_SIZE] = character ;
+  rx_ring_events[rx_ring_head % VLC_RX_RING_SIZE] = event ;
+  // The head is advanced after the slot is written, so the consumer never reads a slot being written.
+  rx_ring_head ++ ;
+}
+
+bool VLC::rx_pop(struct vlc_rx_symbol * symbol){
+  if(rx_ring_tail == rx_ring_head){
+    return false ;
+  }
+  symbol->character = rx_ring_characters[rx_ring_tail % VLC_RX_RING_SIZE] ;
+  symbol->event = rx_ring_events[rx_ring_tail % VLC_RX_RING_SIZE] ;
+  // The slot is released after it has been read.
+  rx_ring_tail ++ ;
+  return true ;
+}
+
+unsigned int VLC::get_rx_overruns(){
+  unsigned int overruns ;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+    overruns = rx_overruns ;
+  }
+  return overruns ;
+}
+
+void VLC::VLC_receive(){
+  // The ADC conversion and the timer are started, unless they keep running from the previous fragment.
+  if(!rx_running){
+    start_sampling();
+    rx_running = true;
+  }
   
   receiving = true;
   while (receiving){
-    if(new_character == 1){
-    received_data = 0 ;
-    // The decoding of the data is carried out, taking into account the use of Manchester coding.
-    for(int i = 0 ; i < 16 ; i = i + 2){
-             received_data = received_data << 1 ;
-             if(((detected_character >> i) & 0x03) == 0x01){
-                 received_data |= 0x01 ;
-             }else{
-                 received_data &= ~0x01 ;
-             }
-    }
-    new_character = 0 ;
-    if((add_byte_to_buffer(frame_buffer, &frame_index, &frame_size, &frame_state,received_data)) > 0){
-      frame_buffer[frame_size-1] = '\0';
-      // It has finished receiving the data.
-      stop_timer();
+    if(process_rx_symbols()){
+      // It has finished receiving the data. The timer keeps running in case a streamed fragment follows.
       receiving = false;
       #if DEBUG == 1
         USB.println(frame_size);
@@ -433,5 +1544,260 @@ void VLC::VLC_receive(){
       #endif
     }
   }
- }
 }
+
+bool VLC::process_rx_symbols(){
+  struct vlc_rx_symbol symbol ;
+  while(rx_pop(&symbol)){
+    if(get_rx_overruns() != rx_overruns_seen){
+      // A character of the frame was lost, so the frame is discarded.
+      rx_overruns_seen = get_rx_overruns();
+      frame_state = WAITING_SYNCHRONIZE ;
+    }
+    if(symbol.event == 2){
+      // The synchronization symbol has been detected, so a new frame starts.
+      frame_index = 0 ;
+      frame_size = 0 ;
+      frame_state = SYNCHRONIZE ;
+      rx_payload_length = -1 ;
+      continue ;
+    }
+    // In the data of a frame with FEC an invalid code is guessed, so the Hamming code can correct it. Otherwise it discards the frame being received.
+    bool fec_data = (rx_options & VLC_OPTION_FEC) && rx_payload_length >= 0 && (frame_state == LENGTH || frame_state == RECEIVING) ;
+    int decoded_data = decode_character(symbol.character, fec_data);
+    if(decoded_data < 0){
+      frame_state = WAITING_SYNCHRONIZE ;
+      continue ;
+    }
+    received_data = decoded_data ;
+    if((add_byte_to_buffer(frame_buffer, &frame_index, &frame_size, &frame_state,received_data)) > 0){
+      frame_buffer[frame_size-1] = '\0';
+      return true ;
+    }
+  }
+  return false ;
+}
+
+int VLC::receive_message(char * buffer, int buffer_size, struct vlc_span * message, unsigned long timeout){
+  if(timeout == 0){
+    timeout = VLC_REASSEMBLY_TIMEOUT ;
+  }
+  reassembly_timeout = timeout ;
+  unsigned long start_time = millis() ;
+  // The sampling is kept running between the fragments.
+  if(!rx_running){
+    start_sampling();
+    rx_running = true;
+  }
+  int result = 0 ;
+  while(result <= 0){
+    if(process_rx_symbols()){
+      result = reassemble_fragment(buffer, buffer_size, message);
+    }else if((millis() - start_time) > timeout && (!reassembly.active || (millis() - reassembly.last_time) > timeout)){
+      // Nothing arrived in time since the call or since the last fragment.
+      if(reassembly.active){
+        // The next fragment did not arrive in time, so the message is abandoned. The bitmap is kept for get_missing_fragments().
+        reassembly_stats.timeouts ++ ;
+        reassembly_stats.lost_fragments += expected_fragments() - reassembly.received_count ;
+        reassembly.active = false ;
+      }
+      break ;
+    }
+  }
+  #if VLC_RX_CONTINUOUS == 1
+  if(rx_continuous){
+    return (result > 0) ? message->size : -1 ;
+  }
+  #endif
+  stop_sampling();
+  rx_running = false;
+  return (result > 0) ? message->size : -1 ;
+}
+
+int VLC::reassemble_fragment(char * buffer, int buffer_size, struct vlc_span * message){
+  const char * data = &(frame_buffer[1]) ;
+  int size = frame_size - 2 ;
+  if(!(rx_options & VLC_OPTION_FRAGMENT)){
+    // A frame without fragment header is a whole message.
+    if(reassembly.active){
+      // An urgent frame sent between the fragments of a message is read from frame_buffer, so the fragments already placed are kept.
+      message->data = data ;
+      message->size = size ;
+      reassembly_stats.messages ++ ;
+      return 1 ;
+    }
+    if(size > buffer_size){
+      reassembly_stats.rejected ++ ;
+      return -1 ;
+    }
+    memcpy(buffer, data, size);
+    message->data = buffer ;
+    message->size = size ;
+    reassembly_stats.messages ++ ;
+    return 1 ;
+  }
+
+  unsigned char message_id = data[0] ;
+  unsigned char index = data[1] ;
+  unsigned char count = data[2] ;
+  unsigned char fragment_size = data[3] ;
+  data += VLC_FRAGMENT_HEADER_SIZE ;
+  size -= VLC_FRAGMENT_HEADER_SIZE ;
+  // Every fragment but the last one is full, so the position of each fragment is known whatever the order of arrival.
+  int offset = index * fragment_size ;
+  // A forwarded fragment with unknown number of fragments is never the last one, so it is full.
+  bool last = (count != VLC_FRAGMENT_COUNT_UNKNOWN) && (index == count - 1) ;
+  if(size < 0 || count > VLC_MAX_FRAGMENTS || index >= VLC_MAX_FRAGMENTS || (count != VLC_FRAGMENT_COUNT_UNKNOWN && index >= count) || size > fragment_size || (!last && size != fragment_size) || offset + size > buffer_size){
+    reassembly_stats.rejected ++ ;
+    return -1 ;
+  }
+
+  // The number of fragments of a forwarded message is learnt from its last fragment.
+  bool other_count = (count != reassembly.count) && (count != VLC_FRAGMENT_COUNT_UNKNOWN) && (reassembly.count != VLC_FRAGMENT_COUNT_UNKNOWN) ;
+  // The bitmap of a delivered or abandoned message only rejects duplicates for a while: the identifiers restart when the emitter reboots and wrap every 256 messages.
+  bool expired = !reassembly.active && (millis() - reassembly.last_time) > reassembly_timeout ;
+  if(message_id != reassembly.message_id || other_count || fragment_size != reassembly.fragment_size || expired){
+    // The fragment belongs to a new message, so the previous one can not be completed.
+    if(reassembly.active){
+      reassembly_stats.lost_fragments += expected_fragments() - reassembly.received_count ;
+    }
+    reassembly.message_id = message_id ;
+    reassembly.count = count ;
+    reassembly.fragment_size = fragment_size ;
+    reassembly.received_count = 0 ;
+    reassembly.last_index = 0 ;
+    reassembly.size = -1 ;
+    memset(reassembly.received, 0, sizeof(reassembly.received));
+  }
+  // A fragment after the last one of its message can not be placed.
+  if(reassembly.count != VLC_FRAGMENT_COUNT_UNKNOWN && index >= reassembly.count){
+    reassembly_stats.rejected ++ ;
+    return -1 ;
+  }
+  // The fragments of a message that was already delivered are duplicates too, since its bitmap is kept.
+  if(reassembly.received[index >> 3] & (1 << (index & 0x07))){
+    reassembly_stats.duplicates ++ ;
+    return 0 ;
+  }
+  reassembly.active = true ;
+  reassembly.last_time = millis() ;
+
+  // The fragment is written at its position, so the message is complete in the buffer once every fragment is received.
+  memcpy(&(buffer[offset]), data, size);
+  reassembly.received[index >> 3] |= (1 << (index & 0x07)) ;
+  reassembly.received_count ++ ;
+  if(index > reassembly.last_index){
+    reassembly.last_index = index ;
+  }
+  if(last){
+    reassembly.count = count ;
+    reassembly.size = offset + size ;
+  }
+  if(reassembly.count == VLC_FRAGMENT_COUNT_UNKNOWN || reassembly.received_count < reassembly.count){
+    return 0 ;
+  }
+  message->data = buffer ;
+  message->size = reassembly.size ;
+  reassembly.active = false ;
+  reassembly_stats.messages ++ ;
+  return 1 ;
+}
+
+int VLC::get_missing_fragments(unsigned char * indexes, int max_indexes){
+  int missing = 0 ;
+  for(int i = 0 ; i < expected_fragments() ; i ++){
+    if(!(reassembly.received[i >> 3] & (1 << (i & 0x07)))){
+      if(missing < max_indexes){
+        indexes[missing] = i ;
+      }
+      missing ++ ;
+    }
+  }
+  return missing ;
+}
+
+struct vlc_reassembly_stats VLC::get_reassembly_stats(){
+  return reassembly_stats ;
+}
+
+void VLC::VLC_forward_begin(){
+  tx_message_id ++ ;
+  tx_forward.message_id = tx_message_id ;
+  tx_forward.fragment_index = 0 ;
+  tx_forward.fragment_size = 0 ;
+}
+
+int VLC::VLC_forward_fragment(char * fragment, int fragment_size, bool last){
+  // A message of one fragment is sent as a whole frame.
+  if(last && tx_forward.fragment_index == 0){
+    return VLC_queue(fragment, fragment_size);
+  }
+
+  // Every fragment but the last one must have the size of the first one, so the receiver can place them.
+  if(fragment_size > VLC_MAX_PAYLOAD - VLC_FRAGMENT_HEADER_SIZE){
+    return -1 ;
+  }
+  if(tx_forward.fragment_index == 0){
+    tx_forward.fragment_size = fragment_size ;
+  }
+  if(tx_forward.fragment_index >= VLC_MAX_FRAGMENTS || fragment_size > tx_forward.fragment_size || (!last && fragment_size != tx_forward.fragment_size)){
+    #if DEBUG_VLC == 1
+      USB.println(F("Fragment can not be forwarded"));
+    #endif
+    return -1 ;
+  }
+
+  tx_forward.fragment_count = last ? tx_forward.fragment_index + 1 : VLC_FRAGMENT_COUNT_UNKNOWN ;
+  return queue_message_frame(&tx_forward, fragment, fragment_size);
+}
+
+#if VLC_RX_CONTINUOUS == 1
+void VLC::VLC_receive_begin(){
+  rx_frame_head = 0 ;
+  rx_frame_tail = 0 ;
+  rx_frames_dropped = 0 ;
+  rx_continuous = true ;
+  if(!rx_running){
+    start_sampling();
+    rx_running = true;
+  }
+}
+
+int VLC::VLC_receive_poll(){
+  while(process_rx_symbols()){
+    if((unsigned char)(rx_frame_head - rx_frame_tail) == VLC_RX_FRAME_SLOTS){
+      rx_frames_dropped ++ ;
+      continue ;
+    }
+    // The data is copied with its '\0', so frame_buffer is free for the next frame, which may already be in the ring.
+    struct vlc_rx_frame * slot = &(rx_frames[rx_frame_head % VLC_RX_FRAME_SLOTS]);
+    slot->size = frame_size - 2 ;
+    memcpy(slot->data, frame_buffer + 1, frame_size - 1);
+    rx_frame_head ++ ;
+  }
+  return (unsigned char)(rx_frame_head - rx_frame_tail) ;
+}
+
+int VLC::VLC_receive_frame(char * data){
+  if(VLC_receive_poll() == 0){
+    return -1 ;
+  }
+  struct vlc_rx_frame * slot = &(rx_frames[rx_frame_tail % VLC_RX_FRAME_SLOTS]);
+  int size = slot->size ;
+  memcpy(data, slot->data, size + 1);
+  rx_frame_tail ++ ;
+  return size ;
+}
+
+void VLC::VLC_receive_end(){
+  rx_continuous = false ;
+  if(rx_running){
+    stop_sampling();
+    rx_running = false;
+  }
+}
+
+unsigned int VLC::get_rx_frames_dropped(){
+  return rx_frames_dropped ;
+}
+#endif
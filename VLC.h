@@ -13,8 +13,10 @@
 ****************************************************************************/
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
 #include <stdio.h>
 #include <util/atomic.h>
+#include <util/crc16.h>
 
 #ifndef __WPROGRAM_H__
   #include "WaspClasses.h"
@@ -33,25 +35,76 @@
 /** Message debug */
 #define DEBUG_VLC 1
 
+/** Defines whether the cycles and the latency of the Timer3 interrupt are measured (1) or the measurement is not compiled (0). */
+#define VLC_ISR_STATS 0
+
+/** Number of bins of the histogram of the latency of the Timer3 interrupt. The last bin counts every latency above the others. */
+#define VLC_ISR_JITTER_BINS 8
+
+/** Width in CPU cycles of each bin of the histogram of the latency. */
+#define VLC_ISR_JITTER_BIN_CYCLES 16
+
+/** Defines whether the whole frame is encoded in Manchester words before its emission (1) or each word is encoded in the interrupt when it is needed (0). Precoded slots take four bytes of SRAM per byte of frame. */
+#define VLC_PRECODED_FRAME 0
+
+/** Emitter backends: the timer interrupt sets TRANSMISSION_PIN in each half bit, or the USART in SPI master mode shifts out eight half bits from its TXD pin in each interrupt. */
+#define VLC_TX_BACKEND_PIN 0
+#define VLC_TX_BACKEND_USART 1
+
+/** Emitter backend used. With VLC_TX_BACKEND_USART the lamp driver has to be connected to the TXD pin of VLC_USART. */
+#define VLC_TX_BACKEND VLC_TX_BACKEND_PIN
+
+/** USART used by the USART backend (0 or 1). The USART must not be used by a socket while the frames are emitted. */
+#define VLC_USART 1
+
 /** Digital transmission Pin. */
 #define TRANSMISSION_PIN 2
 
 /** Analog pin where the voltage received from the VLC receiver circuit will be obtained. */
 #define ANALOG_RECEPTION_PIN 3
 
+/** Receiver front ends: the Timer3 interrupt starts each conversion and waits for it, or Timer1 compare B triggers the conversions and the ADC interrupt processes each sample (Timer3 can not trigger the ADC), or the analog comparator drives the Timer1 input capture and the half bits are decoded from the time between edges. */
+#define VLC_RX_FRONTEND_TIMER 0
+#define VLC_RX_FRONTEND_ADC 1
+#define VLC_RX_FRONTEND_CAPTURE 2
+
+/** Receiver front end used. */
+#define VLC_RX_FRONTEND VLC_RX_FRONTEND_TIMER
+
+/** Defines whether the ADC reads 8 bits left adjusted with a prescaler of 16, about 70 ksamples/s (1), or 10 bits with a prescaler of 128, about 8.8 ksamples/s (0). */
+#define VLC_ADC_8BIT 0
+
 /** Working frequency of the board. */
 #define BOARD_FREQUENCY (14.7456e6)
 
-/** Communication frequency. */
-#define COMMUNICATION_FREQUENCY (2e3)
+/** Communication frequency (half bits per second) used until another one is selected with set_rate(). */
+#define VLC_DEFAULT_RATE VLC_RATE_2K
 
 /** Number of samples for each bit received, to apply oversampling. */
 #define NUMBER_OF_SAMPLES 4
 
+/** Defines whether the receiver follows the clock of the emitter with a digital PLL that estimates the length of the half bits from the edges received (1), or it expects exactly NUMBER_OF_SAMPLES samples in each half bit (0). */
+#define VLC_RX_PLL 1
+
+/** Fractions of a sample in which the receiver measures the time between edges. */
+#define VLC_PLL_SCALE 16
+
+/** Gain of the PLL loop filter: the estimated half bit length is corrected by 1/VLC_PLL_GAIN of the error measured at each edge. */
+#define VLC_PLL_GAIN 8
+
+/** Chips of the Manchester synchronization word that can be wrong for the correlator to accept it. */
+#define VLC_SYNC_MAX_ERRORS 1
+
 /** Word compouse with a bit of start, eight bits of data and a bit of stop. */
 /** Start b7 b6 b5 b4 b3 b2 b1 b0 Stop */
 #define WORD_LENGTH 10
 
+/** Line code used until another one is selected with set_line_code(). */
+#define VLC_DEFAULT_LINE_CODE VLC_LINE_CODE_MANCHESTER
+
+/** Number of half bits (chips) of each byte coded in 4B6B: two 6-chip codes, without start and stop. */
+#define WORD_LENGTH_4B6B 12
+
 /** Synchronization symbol send before the data send. */
 #define SYNCHRONIZE_SYMBOL 0xD5 
 
@@ -61,6 +114,48 @@
 /** End of the frame. */
 #define END_FLAG 0x03
 
+/** Start of a streamed fragment, sent right after the previous frame in place of the preamble and the start flag. */
+#define FRAGMENT_FLAG 0x04
+
+/** Start of a frame with length: the flag is followed by the size of the data and the data, without end flag. */
+#define LENGTH_FLAG 0x05
+
+/** Start of a streamed fragment with length. */
+#define LENGTH_FRAGMENT_FLAG 0x06
+
+/** Option of the frames with length marked in the flag: the frame ends with the CRC-16 of the size and the data. */
+#define VLC_OPTION_CRC 0x10
+
+/** Option of the frames with length marked in the flag: each byte after the flag is sent as two extended Hamming(8,4) codes. */
+#define VLC_OPTION_FEC 0x20
+
+/** Option of the frames with length marked in the flag: the data starts with a fragment header. It is set by send_VLC() for each fragment. */
+#define VLC_OPTION_FRAGMENT 0x40
+
+/** Options that can be marked in the flag of the frames with length. */
+#define VLC_OPTIONS (VLC_OPTION_CRC | VLC_OPTION_FEC | VLC_OPTION_FRAGMENT)
+
+/** Size of the CRC-16 at the end of the frame. */
+#define VLC_CRC_SIZE 2
+
+/** Size of the fragment header: identifier of the message, index of the fragment, number of fragments and size of the fragments but the last one. */
+#define VLC_FRAGMENT_HEADER_SIZE 4
+
+/** Most fragments of a message that the receiver can reassemble. */
+#define VLC_MAX_FRAGMENTS 64
+
+/** Number of fragments sent by VLC_forward_fragment() before the last fragment, when the size of the message is not known yet. The last fragment carries the real number. */
+#define VLC_FRAGMENT_COUNT_UNKNOWN 0
+
+/** Time (ms) that the reassembly of a message waits for its next fragment until it is abandoned, when receive_message() is not given another one. Once this time has elapsed since the last fragment of a message, a fragment with its identifier starts a new message. */
+#define VLC_REASSEMBLY_TIMEOUT 10000
+
+/** Frame format used until another one is selected with set_frame_format(). */
+#define VLC_DEFAULT_FRAME_FORMAT VLC_FRAME_LENGTH
+
+/** Size of the preamble (0xAA bytes and synchronization symbol) sent before the start flag. */
+#define PREAMBLE_SIZE 4
+
 /** ADC voltage reference */
 //#define ADC_REF_1.1   /// Internal reference 1.1v
 //#define ADC_REF_2.56  /// Internal reference 2.56v
@@ -69,8 +164,56 @@
 /** Difference threshold in reading ADC values to determine high and low levels. */
 #define DIFFERENCE_THRESHOLD 1
 
-/** Data maximum. */
-#define DATA_MAX 50
+/** Data maximum of a frame. The size of the data is sent in one byte, so it can not exceed 255. */
+#define VLC_MAX_PAYLOAD 255
+
+/** Maximum size of a frame: preamble, flag, size or end flag, data and CRC. */
+#define FRAME_MAX (PREAMBLE_SIZE + 2 + VLC_MAX_PAYLOAD + VLC_CRC_SIZE)
+
+/** Number of frame slots of the transmit queue. */
+#define VLC_TX_QUEUE_SLOTS 2
+
+/** Number of characters that the receive interrupt can detect before they are processed. It must be a power of two up to 128. */
+#define VLC_RX_RING_SIZE 32
+
+/** Defines whether the continuous reception and its received frame queue are compiled (1) or not (0). Emitter-only builds leave it at 0, so the queue does not take SRAM. */
+#define VLC_RX_CONTINUOUS 0
+
+/** Number of frames that the continuous reception keeps until they are read. It must be a power of two up to 128. Each slot takes VLC_MAX_PAYLOAD + 2 bytes of SRAM. */
+#define VLC_RX_FRAME_SLOTS 2
+
+/** Registers and pins of the USART used by the USART backend. */
+#if VLC_USART == 0
+  #define VLC_UDR UDR0
+  #define VLC_UCSRB UCSR0B
+  #define VLC_UCSRC UCSR0C
+  #define VLC_UBRR UBRR0
+  #define VLC_USART_UDRE_vect USART0_UDRE_vect
+  #define VLC_USART_PORT PORTE
+  #define VLC_USART_DDR DDRE
+  #define VLC_USART_TXD_BIT 1   /// PE1 (TXD0)
+  #define VLC_USART_XCK_BIT 2   /// PE2 (XCK0), output in master mode
+#else
+  #define VLC_UDR UDR1
+  #define VLC_UCSRB UCSR1B
+  #define VLC_UCSRC UCSR1C
+  #define VLC_UBRR UBRR1
+  #define VLC_USART_UDRE_vect USART1_UDRE_vect
+  #define VLC_USART_PORT PORTD
+  #define VLC_USART_DDR DDRD
+  #define VLC_USART_TXD_BIT 3   /// PD3 (TXD1)
+  #define VLC_USART_XCK_BIT 5   /// PD5 (XCK1), output in master mode
+#endif
+
+/** Bits of UCSRnB and UCSRnC in SPI master mode, which are the same in both USARTs. */
+#define VLC_UDRIE 5   /// Data register empty interrupt
+#define VLC_TXEN 3    /// Transmitter enable
+#define VLC_UMSEL1 7  /// UMSELn1 and UMSELn0 select SPI master mode
+#define VLC_UMSEL0 6
+#define VLC_UDORD 2   /// Least significant bit first
+
+/** Value of the baud rate register for the frequencies that the USART can not reach. */
+#define VLC_USART_UNSUPPORTED 0xFFFF
 
 /** Pin configuration as output pin. */
 #define PIN_OUT() DDRA |= ((1 << TRANSMISSION_PIN))
@@ -93,6 +236,31 @@
 /** Manchester syncronization symbol. */
 #define SYNC_SYMBOL_MANCHESTER  (0x6665)
 
+/** Chips compared by the synchronization correlator: the stop of the previous word, the start, the 16 chips of the character and the stop. */
+#define SYNC_CORRELATOR_MASK (0x1FFFFFUL)
+
+/** Chips of the Manchester synchronization word as they are received. */
+#define SYNC_CORRELATOR_WORD ((unsigned long)START_STOP_MASK | ((unsigned long)SYNC_SYMBOL_MANCHESTER << 2))
+
+/** 4B6B syncronization symbol as it is received (first chip in the most significant bit): 111110000001. Its runs of five and six chips cannot appear in 4B6B data. */
+#define SYNC_SYMBOL_4B6B (0xF81)
+
+/** 4B6B syncronization symbol as it is sent (first chip in the least significant bit). */
+#define SYNC_WORD_4B6B (0x81FUL)
+
+/** Longest run of equal chips that the receiver reconstructs in Manchester. The code has runs of two chips, but a wrong chip can join two of them, and they are kept so that the following chips stay aligned. */
+#define MAX_RUN_MANCHESTER 5
+
+/** Longest run of equal chips that the receiver reconstructs in 4B6B (the run of zeros of the syncronization symbol). */
+#define MAX_RUN_4B6B 6
+
+/** Manchester half bits of the data bit i of the byte b, placed after the start symbol (data LSB first). */
+#define MANCHESTER_BIT(b, i) (((((b) >> (i)) & 0x01) ? 0x02UL : 0x01UL) << (2 + 2 * (i)))
+
+/** Manchester word (start, eight data bits and stop) of the byte b, in the order in which it is sent. */
+#define MANCHESTER_WORD(b) ((0x02UL << 18) | MANCHESTER_BIT(b, 7) | MANCHESTER_BIT(b, 6) | MANCHESTER_BIT(b, 5) | MANCHESTER_BIT(b, 4) | \
+                            MANCHESTER_BIT(b, 3) | MANCHESTER_BIT(b, 2) | MANCHESTER_BIT(b, 1) | MANCHESTER_BIT(b, 0) | 0x01UL)
+
 /****************************************************************************
 *                           Enumerations                                    *
 ****************************************************************************/
@@ -101,7 +269,193 @@ enum receiver_state {
   WAITING_SYNCHRONIZE, /// Waiting for synchronization
   SYNCHRONIZE, /// Synchronized, waiting for start flag (START_FLAG)
   START, /// Flag of start data received
-  RECEIVING /// Receiving DATA
+  LENGTH, /// Flag of a frame with length received, waiting for the size of the data
+  RECEIVING, /// Receiving DATA
+  END /// Frame received, a streamed fragment can follow without synchronization
+};
+
+/** Transmission states of a frame sent through the transmit queue. */
+enum vlc_tx_status {
+  VLC_TX_QUEUED, /// Frame waiting in the transmit queue
+  VLC_TX_SENDING, /// Frame being emitted
+  VLC_TX_DONE /// Frame emitted
+};
+
+/** Communication frequencies (half bits per second) that can be selected for the VLC link. */
+enum vlc_rate {
+  VLC_RATE_1K, /// 1 kbaud
+  VLC_RATE_2K, /// 2 kbaud
+  VLC_RATE_4K, /// 4 kbaud
+  VLC_RATE_8K, /// 8 kbaud
+  VLC_RATE_16K, /// 16 kbaud
+  VLC_RATE_COUNT /// Number of communication frequencies
+};
+
+/** Line codes that can be selected for the VLC link. */
+enum vlc_line_code {
+  VLC_LINE_CODE_MANCHESTER, /// Manchester with start and stop, 20 chips per byte
+  VLC_LINE_CODE_4B6B /// IEEE 802.15.7 4B6B, 12 chips per byte
+};
+
+/** Frame formats that can be sent through the VLC link. The receiver accepts both. */
+enum vlc_frame_format {
+  VLC_FRAME_END_FLAG, /// The data ends with END_FLAG, so it can not contain that byte
+  VLC_FRAME_LENGTH /// The size of the data follows the flag, so the data can contain any byte
+};
+
+/****************************************************************************
+*                             Templates                                     *
+****************************************************************************/
+
+/** Bits of TCCR3B that select the prescaler of Timer3. Only the prescalers used by the rate profiles are defined. */
+template<unsigned int PRESCALER> struct timer3_prescaler;
+
+template<> struct timer3_prescaler<1> {
+  static constexpr unsigned char bits = (1 << CS30);
+  static constexpr unsigned char shift = 0;
+};
+
+template<> struct timer3_prescaler<8> {
+  static constexpr unsigned char bits = (1 << CS31);
+  static constexpr unsigned char shift = 3;
+};
+
+template<> struct timer3_prescaler<64> {
+  static constexpr unsigned char bits = (1 << CS31) | (1 << CS30);
+  static constexpr unsigned char shift = 6;
+};
+
+/** Timer3 configuration of a communication frequency, computed at compile time. */
+template<unsigned long RATE, unsigned int PRESCALER> struct vlc_timing {
+  /** Bits of the prescaler. */
+  static constexpr unsigned char prescaler_bits = timer3_prescaler<PRESCALER>::bits;
+  /** Shift that converts timer ticks to CPU cycles. */
+  static constexpr unsigned char prescaler_shift = timer3_prescaler<PRESCALER>::shift;
+  /** Compare value to emit a half bit in each interrupt. */
+  static constexpr unsigned int emitter_compare = (unsigned int)(BOARD_FREQUENCY / PRESCALER / RATE + 0.5) - 1;
+  /** Compare value to take NUMBER_OF_SAMPLES samples of each half bit. */
+  static constexpr unsigned int receiver_compare = (unsigned int)(BOARD_FREQUENCY / PRESCALER / RATE / NUMBER_OF_SAMPLES + 0.5) - 1;
+  /** Baud rate register of the USART in SPI master mode to shift a half bit in each clock, if it fits in its 12 bits. */
+  static constexpr unsigned int usart_ubrr = (BOARD_FREQUENCY / 2 / RATE + 0.5) - 1 <= 4095 ? (unsigned int)(BOARD_FREQUENCY / 2 / RATE + 0.5) - 1 : VLC_USART_UNSUPPORTED;
+
+  static_assert(BOARD_FREQUENCY / PRESCALER / RATE <= 65536, "The compare value does not fit in Timer3");
+  static_assert(receiver_compare > 0, "The oversampling is too fast for the prescaler");
+};
+
+static_assert(VLC_MAX_PAYLOAD <= 255, "The size of the data is sent in one byte");
+
+static_assert(VLC_MAX_FRAGMENTS <= 255 && VLC_MAX_FRAGMENTS % 8 == 0, "The number of fragments is sent in one byte and tracked in whole bytes of the bitmap");
+
+static_assert(VLC_RX_RING_SIZE <= 128 && (VLC_RX_RING_SIZE & (VLC_RX_RING_SIZE - 1)) == 0, "The receive ring size must be a power of two up to 128");
+
+#if VLC_RX_CONTINUOUS == 1
+static_assert(VLC_RX_FRAME_SLOTS <= 128 && (VLC_RX_FRAME_SLOTS & (VLC_RX_FRAME_SLOTS - 1)) == 0, "The received frame queue size must be a power of two up to 128");
+#endif
+
+/****************************************************************************
+*                             Structures                                    *
+****************************************************************************/
+
+/** Timer3 configuration of a communication frequency. */
+struct vlc_rate_profile {
+  unsigned char prescaler_bits; /// Bits of the prescaler in TCCR3B
+  unsigned char prescaler_shift; /// Shift from timer ticks to CPU cycles
+  unsigned int emitter_compare; /// Compare value of the emitter
+  unsigned int receiver_compare; /// Compare value of the receiver
+  unsigned int usart_ubrr; /// Baud rate register of the USART backend
+};
+
+/** Frame described in three parts that are read in order: the header, the data in the buffer of the caller and the trailer. */
+struct vlc_frame_descriptor {
+  char header [PREAMBLE_SIZE + 2 + VLC_FRAGMENT_HEADER_SIZE]; /// Preamble, flag, size of the data and fragment header
+  unsigned char header_size; /// Bytes of the header
+  const char * payload; /// Data of the frame, which is not copied
+  unsigned char payload_size; /// Bytes of data
+  char trailer [VLC_CRC_SIZE]; /// End flag or CRC
+  unsigned char trailer_size; /// Bytes of the trailer
+};
+
+/** Slot of the transmit queue where a frame waits until it is emitted. */
+struct vlc_tx_slot {
+  struct vlc_frame_descriptor frame; /// Frame to send
+  #if VLC_PRECODED_FRAME == 1
+  unsigned long int words [FRAME_MAX]; /// Frame to send encoded in words of the line code
+  #endif
+  int size; /// Size of the frame
+  bool continuation; /// Determines if the frame is a streamed fragment that follows the previous frame without preamble
+  bool fec; /// Determines if the interrupt has to send each byte after the flag as two Hamming codes
+  #if VLC_PRECODED_FRAME == 1
+  bool encoded; /// Determines if the frame is saved in words (true) or in bytes (false)
+  #endif
+};
+
+/** Fragmented message whose frames are being queued. */
+struct vlc_tx_message {
+  unsigned char message_id; /// Identifier of the message
+  unsigned char fragment_index; /// Index of the next fragment to queue
+  unsigned char fragment_count; /// Number of fragments of the message, VLC_FRAGMENT_COUNT_UNKNOWN while a forwarded message has not ended
+  unsigned char fragment_size; /// Size of every fragment but the last one
+  bool streamed; /// Determines if each fragment after the first one follows the previous frame without preamble
+};
+
+/** Measurements of the Timer3 interrupt. */
+struct vlc_isr_stats {
+  unsigned int min_cycles; /// Fewest CPU cycles spent in the interrupt
+  unsigned int max_cycles; /// Most CPU cycles spent in the interrupt
+  unsigned long total_cycles; /// CPU cycles spent in all the measured interrupts
+  unsigned long count; /// Number of measured interrupts
+  unsigned int overruns; /// Compare matches that arrived while the interrupt was still running, so they were served late or lost
+  unsigned int jitter [VLC_ISR_JITTER_BINS]; /// Histogram of the CPU cycles from the compare match to the start of the interrupt
+};
+
+/** Character detected by the receive interrupt. */
+struct vlc_rx_symbol {
+  unsigned int character; /// Half bits of the character
+  unsigned char event; /// 1 for a character and 2 for the synchronization symbol, as returned by insert_character()
+};
+
+#if VLC_RX_CONTINUOUS == 1
+/** Slot of the queue where a received frame waits until it is read. */
+struct vlc_rx_frame {
+  char data [VLC_MAX_PAYLOAD + 1]; /// Data of the frame, ended with '\0'
+  unsigned char size; /// Bytes of data
+};
+#endif
+
+/** Part of a buffer that holds a received message, which is not copied again. */
+struct vlc_span {
+  const char * data; /// First byte of the message
+  int size; /// Bytes of the message
+};
+
+/** Message being reassembled from its fragments. */
+struct vlc_reassembly {
+  bool active; /// Determines if a fragment of the message has been received
+  unsigned char message_id; /// Identifier of the message
+  unsigned char count; /// Number of fragments of the message, VLC_FRAGMENT_COUNT_UNKNOWN until the last fragment of a forwarded message is received
+  unsigned char fragment_size; /// Size of every fragment but the last one
+  unsigned char received_count; /// Number of different fragments received
+  unsigned char last_index; /// Highest index of the fragments received
+  unsigned char received [VLC_MAX_FRAGMENTS / 8]; /// Bitmap of the received fragments, fragment i in bit i % 8 of byte i / 8
+  int size; /// Size of the message, known once the last fragment is received
+  unsigned long last_time; /// Time (ms) when the last fragment was received
+};
+
+/** Counters of the reassembly of the fragmented messages. */
+struct vlc_reassembly_stats {
+  unsigned int messages; /// Messages delivered
+  unsigned int timeouts; /// Messages abandoned because a fragment did not arrive in time
+  unsigned int lost_fragments; /// Fragments missing from the abandoned messages
+  unsigned int duplicates; /// Fragments received twice
+  unsigned int rejected; /// Fragments with an invalid header or out of the buffer
+};
+
+/** Counters of the errors detected in the received frames. */
+struct vlc_error_stats {
+  unsigned int crc_errors; /// Frames discarded because the CRC does not match
+  unsigned int fec_corrected; /// Hamming codes with one error that was corrected
+  unsigned int fec_uncorrectable; /// Hamming codes with two errors, whose frame was discarded
+  unsigned int invalid_codes; /// Characters that are not a valid line code: guessed in frames with FEC, which discard the frame otherwise
 };
 
 class VLC{
@@ -137,14 +491,14 @@ class VLC{
     * 
     * \param Frame of data.
     * 
-    * Function that initilize the frame with the parameters associated to the syncronize and the start of the data.
+    * Function that writes in the frame the parameters associated to the syncronize and the start of the data.
     */
     void int_frame(char* frame);
 
     /**
     * \fn void int_emitter()
     * 
-    * Function that initilize the variables that are used in the emision process.
+    * Function that initilize the variables that are used in the emision process and empties the transmit queue.
     */
     void int_emitter();
   
@@ -152,11 +506,125 @@ class VLC{
     * \fn void create_frame(char* data, int data_size)
     * \param Data to be sent via VLC that will be included in the frame.
     * \param Size of the data to send.
-    * \return A 0 is returned if the frame was created successfully. -1 is returned if the maximum data size is exceeded or data is being sent (frame_index> = 0).
+    * \return The ticket of the frame (0-255) is returned if the frame was created successfully. -1 is returned if the maximum data size is exceeded or the transmit queue is full.
     * 
-    * Function that build the frame that is send via VLC.
+    * Function that build the descriptor of the frame that is send via VLC in a free slot of the transmit queue. The data is not copied, so it must not be modified until the frame has been emitted.
     */
     int create_frame(char* data, int data_size);
+
+    #if VLC_PRECODED_FRAME == 1
+    /**
+    * \fn int create_encoded_frame(char* data, int data_size)
+    * \param Data to be sent via VLC that will be included in the frame.
+    * \param Size of the data to send.
+    * \return The ticket of the frame (0-255) is returned if the frame was created successfully. -1 is returned if the maximum data size is exceeded, the frame encoded with FEC does not fit in the slot or the transmit queue is full.
+    * 
+    * Function that build the frame that is send via VLC in a free slot of the transmit queue and encodes all of it in Manchester words before the emission, so the interrupt only has to load each word.
+    */
+    int create_encoded_frame(char* data, int data_size);
+    #endif
+
+    /**
+    * \fn int write_frame(char * data, int data_size, bool continuation, char * frame)
+    * \param Data to be sent that will be included in the frame.
+    * \param Size of the data to send.
+    * \param Determines if the frame is a streamed fragment.
+    * \param Frame that will be sent through VLC.
+    * \return Size of the frame.
+    * 
+    * Function that writes the preamble, the flag, the size or end flag of the selected frame format and the data in the frame.
+    */
+    int write_frame(char * data, int data_size, bool continuation, char * frame);
+
+    /**
+    * \fn int describe_frame(char * data, int data_size, bool continuation, struct vlc_frame_descriptor * descriptor)
+    * \param Data to be sent that will be included in the frame.
+    * \param Size of the data to send.
+    * \param Determines if the frame is a streamed fragment.
+    * \param Descriptor of the frame that will be sent through VLC.
+    * \return Size of the frame.
+    * 
+    * Function that writes the header and the trailer of the selected frame format in the descriptor, which points to the data without copying it.
+    */
+    int describe_frame(char * data, int data_size, bool continuation, struct vlc_frame_descriptor * descriptor);
+
+    /**
+    * \fn int gather_frame(struct vlc_frame_descriptor * descriptor, char * frame)
+    * \param Descriptor of the frame.
+    * \param Buffer where the whole frame is written.
+    * \return Size of the frame.
+    * 
+    * Function that joins the header, the data and the trailer of the descriptor in a buffer.
+    */
+    int gather_frame(struct vlc_frame_descriptor * descriptor, char * frame);
+
+    /**
+    * \fn int set_frame_format(enum vlc_frame_format frame_format)
+    * \param Format of the frames to send.
+    * \return A 0 is returned if the format was selected. -1 is returned if the format does not exist.
+    * 
+    * Function that selects the format of the frames that are queued from now on.
+    */
+    int set_frame_format(enum vlc_frame_format frame_format);
+
+    /**
+    * \fn int set_frame_options(unsigned char frame_options)
+    * \param Options of the frames to send: 0, VLC_OPTION_CRC, VLC_OPTION_FEC or both.
+    * \return A 0 is returned if the options were selected. -1 is returned if an option does not exist.
+    * 
+    * Function that selects the error detection and correction of the frames with length that are queued from now on.
+    */
+    int set_frame_options(unsigned char frame_options);
+
+    /**
+    * \fn struct vlc_error_stats get_error_stats()
+    * \return Counters of the errors detected in the received frames.
+    * 
+    * Function that returns the errors detected and corrected since the receiver was initialized.
+    */
+    struct vlc_error_stats get_error_stats();
+
+    /**
+    * \fn unsigned int get_rx_overruns()
+    * \return Number of characters lost because the receive ring was full.
+    * 
+    * Function that returns the characters that the receive interrupt could not save since the receiver was initialized. The frame being received when a character is lost is discarded.
+    */
+    unsigned int get_rx_overruns();
+
+    #if VLC_ISR_STATS == 1
+    /**
+    * \fn void record_isr(unsigned int entry_ticks, unsigned int exit_ticks, bool overrun)
+    * \param Value of TCNT3 at the start of the interrupt.
+    * \param Value of TCNT3 at the end of the interrupt.
+    * \param Determines if a new compare match arrived while the interrupt was running.
+    * 
+    * Function called at the end of the Timer3 interrupt that adds its measurement to the statistics.
+    */
+    void record_isr(unsigned int entry_ticks, unsigned int exit_ticks, bool overrun);
+
+    /**
+    * \fn struct vlc_isr_stats get_isr_stats()
+    * \return Measurements of the Timer3 interrupt since the last reset.
+    * 
+    * Function that returns a consistent copy of the measurements of the Timer3 interrupt.
+    */
+    struct vlc_isr_stats get_isr_stats();
+
+    /**
+    * \fn void reset_isr_stats()
+    * 
+    * Function that clears the measurements of the Timer3 interrupt.
+    */
+    void reset_isr_stats();
+
+    /**
+    * \fn void print_isr_stats()
+    * 
+    * Function that prints through USB the measurements of the Timer3 interrupt: minimum, average and maximum cycles, overruns and the histogram of the latency.
+    */
+    void print_isr_stats();
+    #endif
   
     /**
     * \fn void write_data_frame(char * data, int data_size, char * frame)
@@ -168,10 +636,28 @@ class VLC{
     */
     void write_data_frame(char * data, int data_size, char * frame);
   
+    /**
+    * \fn int set_rate(enum vlc_rate rate)
+    * \param Communication frequency of the VLC link. Emitter and receiver must use the same one.
+    * \return A 0 is returned if the frequency was selected. -1 is returned if the frequency does not exist or the USART backend can not reach it.
+    * 
+    * Function that selects the communication frequency, which is applied the next time the timer is started.
+    */
+    int set_rate(enum vlc_rate rate);
+
+    /**
+    * \fn int set_line_code(enum vlc_line_code line_code)
+    * \param Line code of the VLC link. Emitter and receiver must use the same one.
+    * \return A 0 is returned if the line code was selected. -1 is returned if the line code does not exist or a frame is being sent.
+    * 
+    * Function that selects the line code used to send and receive the bytes.
+    */
+    int set_line_code(enum vlc_line_code line_code);
+
     /**
     * \fn void start_timer()
     * 
-    * Function that initilize the timer.
+    * Function that initilize the timer with the prescaler and compare value of the selected communication frequency.
     */
     void start_timer();
   
@@ -217,35 +703,179 @@ class VLC{
     * Function responsible for sending data through VLC.
     */
     void send_half_bit();
+
+    #if VLC_TX_BACKEND == VLC_TX_BACKEND_USART
+    /**
+    * \fn void send_usart_byte()
+    * 
+    * Function called by the data register empty interrupt of the USART, which loads the next eight half bits to send.
+    */
+    void send_usart_byte();
+    #endif
   
     /**
     * \fn void data_to_manchester(unsigned char data, unsigned long int * data_manchester)
     * \param Data to be converted.
     * \param Pointer where the data converted through Manchester coding is saved.
     * 
-    * Function that passes the data to its equivalent in Manchester coding.
+    * Function that passes the data to its equivalent in Manchester coding, reading it from the precomputed table stored in flash.
     */
     void data_to_manchester(unsigned char data, unsigned long int * data_manchester);
 
+    /**
+    * \fn void data_to_4b6b(unsigned char data, unsigned long int * data_4b6b)
+    * \param Data to be converted.
+    * \param Pointer where the data converted through 4B6B coding is saved.
+    * 
+    * Function that passes the data to its equivalent in 4B6B coding.
+    */
+    void data_to_4b6b(unsigned char data, unsigned long int * data_4b6b);
+
+    /**
+    * \fn void sync_to_word(unsigned long int * word)
+    * \param Pointer where the word to send is saved.
+    * 
+    * Function that obtains the synchronization word of the selected line code, sent in the last position of the preamble.
+    */
+    void sync_to_word(unsigned long int * word);
+
+    /**
+    * \fn void encode_data(unsigned char data, unsigned long int * word)
+    * \param Data to be converted.
+    * \param Pointer where the word to send is saved.
+    * 
+    * Function that passes the data to its equivalent in the selected line code.
+    */
+    void encode_data(unsigned char data, unsigned long int * word);
+
+    /**
+    * \fn int decode_character(unsigned int character, bool guess)
+    * \param Character detected by the receiver.
+    * \param True to guess the byte of an invalid code instead of rejecting it.
+    * \return The decoded byte is returned. -1 is returned if the character is not a valid code and it is not guessed.
+    * 
+    * Function that obtains the byte of a character received in the selected line code. A wrong chip always gives an invalid code, so in frames with FEC the byte is guessed and the Hamming code corrects the wrong bit: each Manchester pair is decoded by its first chip and each 4B6B code by the nearest valid code that completes a Hamming code.
+    */
+    int decode_character(unsigned int character, bool guess);
+
     /**
     * \fn void send_VLC(char * msg, int msg_size)
     * \param Pointer associated with the message to be sent through VLC.
     * \param Size of the data to send.
     * \param Size of the data fragment to send.
     * 
-    * Function responsible for generating the sending of data through VLC.
+    * Function responsible for generating the sending of data through VLC. The fragments are read from the message, so it returns when the last one has been emitted. With frames with length every fragment carries a fragment header, so receive_message() can reassemble the message.
     */
     void send_VLC(char * msg, int msg_size, int fragment_size);
 
+    /**
+    * \fn int send_VLC_begin(char * msg, int msg_size, int fragment_size)
+    * \param Pointer associated with the message to be sent through VLC.
+    * \param Size of the data to send.
+    * \param Size of the data fragment to send.
+    * \return 0 if the sending has started, -1 if the message has too many fragments.
+    * 
+    * Function that starts the sending of a message like send_VLC(), but returns immediately. The fragments are queued by send_VLC_poll(), and the message must not be modified until it returns false. Frames queued meanwhile by other calls are sent whole between its fragments.
+    */
+    int send_VLC_begin(char * msg, int msg_size, int fragment_size);
+
+    /**
+    * \fn bool send_VLC_poll()
+    * \return True while the message started by send_VLC_begin() is being sent.
+    * 
+    * Function that queues the fragments of the message that fit in the transmit queue without waiting, and returns if the emission has not finished.
+    */
+    bool send_VLC_poll();
+
     /**
     * \fn void VLC_send(char * msg, int msg_size)
     * \param Pointer associated with the message to be sent through LoRaWAN.
     * \param Size of the data to send.
     * 
-    * Function responsible for the call to the VLC sending function in addition to the processing of the data, highlighting the possible fragmentation of these.
+    * Function responsible for the call to the VLC sending function in addition to the processing of the data, highlighting the possible fragmentation of these. It waits until the frame has been emitted.
     */
     void VLC_send(char * msg, int msg_size);
 
+    /**
+    * \fn int VLC_send_async(char * msg, int msg_size)
+    * \param Pointer associated with the message to be sent through VLC.
+    * \param Size of the data to send.
+    * \return The ticket of the frame (0-255) is returned if the frame has been queued. -1 is returned if the transmit queue is full or the maximum data size is exceeded.
+    * 
+    * Function that puts the frame in the transmit queue and returns immediately. The queue is drained by the timer interrupt, which is started if it is stopped. The message is read from its buffer during the emission, so it must not be modified until the ticket is VLC_TX_DONE.
+    */
+    int VLC_send_async(char * msg, int msg_size);
+
+    /**
+    * \fn int VLC_queue(char * msg, int msg_size)
+    * \param Pointer associated with the message to be sent through VLC.
+    * \param Size of the data to send.
+    * \return The ticket of the frame (0-255) is returned if the frame has been queued. -1 is returned if the maximum data size is exceeded.
+    * 
+    * Function that puts the frame in the transmit queue, waiting only while the queue is full. The message must not be modified until the ticket is VLC_TX_DONE.
+    */
+    int VLC_queue(char * msg, int msg_size);
+
+    /**
+    * \fn enum vlc_tx_status VLC_send_status(int ticket)
+    * \param Ticket returned when the frame was queued.
+    * \return Transmission state of the frame.
+    * 
+    * Function that returns if the frame is waiting in the queue, being emitted or already emitted.
+    */
+    enum vlc_tx_status VLC_send_status(int ticket);
+
+    /**
+    * \fn int VLC_tx_free_slots()
+    * \return Number of free slots of the transmit queue.
+    * 
+    * Function that returns the number of frames that can be queued without waiting.
+    */
+    int VLC_tx_free_slots();
+
+    /**
+    * \fn void VLC_stream_begin()
+    * 
+    * Function that opens a stream: the timer is kept running until VLC_stream_end() and every queued frame after the first one is sent right after the previous one, with the fragment flag in place of the preamble.
+    */
+    void VLC_stream_begin();
+
+    /**
+    * \fn void VLC_stream_end()
+    * 
+    * Function that closes the stream, letting the interrupt stop the timer once the queue is empty.
+    */
+    void VLC_stream_end();
+
+    #if DEBUG_VLC == 1
+    /**
+    * \fn void benchmark_streaming(int msg_size, int fragment_size)
+    * \param Size of the message to send.
+    * \param Size of each fragment.
+    * 
+    * Function that sends the same message as independent frames and as a stream, printing through USB the goodput obtained in each case.
+    */
+    void benchmark_streaming(int msg_size, int fragment_size);
+
+    /**
+    * \fn void benchmark_error_correction(unsigned long ber_ppm, int frames, int payload_size)
+    * \param Chip error rate injected, in errors per million chips of the line code.
+    * \param Number of frames sent with each option.
+    * \param Size of the data of each frame.
+    * 
+    * Function that passes frames without options, with CRC and with CRC and FEC through a software loopback that flips chips of the selected line code at the given rate and decodes them as the receiver does, printing through USB the frames received correctly, discarded and accepted with errors, and the goodput at the selected frequency. The synchronization symbol is not disturbed, and a wrong Manchester start or stop chip discards the frame. It must be called while the link is idle.
+    */
+    void benchmark_error_correction(unsigned long ber_ppm, int frames, int payload_size);
+    #endif
+
+    /**
+    * \fn void set_tx_callback(void (*callback)(int ticket))
+    * \param Function called with the ticket of each frame when its emission finishes. It is called from the timer interrupt, so it must be short.
+    * 
+    * Function that sets the function that notifies the end of the emission of the frames.
+    */
+    void set_tx_callback(void (*callback)(int ticket));
+
     /**
     * \fn void init_VLC_receptor()
     * 
@@ -260,13 +890,94 @@ class VLC{
     */
     void VLC_receive();
 
+    #if VLC_RX_CONTINUOUS == 1
+    /**
+    * \fn void VLC_receive_begin()
+    * 
+    * Function that starts the continuous reception: the sampling is kept running until VLC_receive_end() and every frame received is saved in the received frame queue, so the frames sent one after the other are not lost while the previous one is processed.
+    */
+    void VLC_receive_begin();
+
+    /**
+    * \fn int VLC_receive_poll()
+    * \return Number of frames waiting in the received frame queue.
+    * 
+    * Function that processes the characters detected by the receive interrupt and saves the completed frames in the queue. It returns immediately, so it must be called often enough for the receive ring not to overflow. If the queue is full, the new frame is discarded.
+    */
+    int VLC_receive_poll();
+
+    /**
+    * \fn int VLC_receive_frame(char * data)
+    * \param Pointer to the buffer where the data of the frame is saved, ended with '\0'. It must hold VLC_MAX_PAYLOAD + 1 bytes.
+    * \return Size of the data of the oldest received frame, which is removed from the queue. -1 is returned if no frame has been received.
+    * 
+    * Function that takes the oldest frame of the continuous reception.
+    */
+    int VLC_receive_frame(char * data);
+
+    /**
+    * \fn void VLC_receive_end()
+    * 
+    * Function that stops the sampling of the continuous reception. The frames in the queue can still be read.
+    */
+    void VLC_receive_end();
+
+    /**
+    * \fn unsigned int get_rx_frames_dropped()
+    * \return Number of frames discarded because the received frame queue was full.
+    * 
+    * Function that returns the frames of the continuous reception that were lost since the reception began.
+    */
+    unsigned int get_rx_frames_dropped();
+    #endif
+
+    /**
+    * \fn int receive_message(char * buffer, int buffer_size, struct vlc_span * message, unsigned long timeout)
+    * \param Pointer to the buffer where the fragments are placed.
+    * \param Size of the buffer.
+    * \param Part of the buffer that holds the message once it is complete. A whole frame received while a message is being reassembled is not copied to the buffer, so the fragments already placed are kept: its span points into the receiver and is only valid until the next call.
+    * \param Time (ms) to wait for a frame from the call and for the next fragment of a message, or VLC_REASSEMBLY_TIMEOUT if it is 0. It is also the time after which the identifier of a finished message can start a new one.
+    * \return Size of the message. -1 is returned if nothing arrived in time or a fragment did not arrive in time, and get_missing_fragments() tells which ones.
+    * 
+    * Function that receives the fragments sent by send_VLC(), in any order, and writes each one directly at its position in the buffer, so the message is not copied once it is complete. The duplicated fragments are ignored. A frame without fragment header is a whole message, and the message being reassembled is resumed by the next call.
+    */
+    int receive_message(char * buffer, int buffer_size, struct vlc_span * message, unsigned long timeout);
+
+    /**
+    * \fn int get_missing_fragments(unsigned char * indexes, int max_indexes)
+    * \param Pointer to the array where the indexes of the missing fragments are saved.
+    * \param Size of the array.
+    * \return Number of fragments of the last message that have not been received.
+    * 
+    * Function that tells which fragments of the last message reassembled were lost, so only those can be sent again.
+    */
+    int get_missing_fragments(unsigned char * indexes, int max_indexes);
+
     /**
-    * \fn void receive_VLC(char * data)
-    * \param Pointer associated to the buffer where the received data is saved.
+    * \fn struct vlc_reassembly_stats get_reassembly_stats()
+    * \return Counters of the reassembly of the fragmented messages.
     * 
-    * Function responsible for the call to the function of the collection of data received through VLC and the processing of the data received, in case there is fragmentation..
+    * Function that returns the messages delivered and the fragments lost, duplicated or rejected since the receiver was initialized.
     */
-    void receive_VLC(char * data);   
+    struct vlc_reassembly_stats get_reassembly_stats();
+
+    /**
+    * \fn void VLC_forward_begin()
+    * 
+    * Function that starts a message whose fragments are queued by VLC_forward_fragment() as they arrive, before the size of the message is known.
+    */
+    void VLC_forward_begin();
+
+    /**
+    * \fn int VLC_forward_fragment(char * fragment, int fragment_size, bool last)
+    * \param Pointer associated with the fragment to be sent through VLC.
+    * \param Size of the fragment. Every fragment but the last one must have the size of the first one.
+    * \param True if it is the last fragment of the message.
+    * \return The ticket of the frame (0-255) is returned if the fragment has been queued. -1 is returned if the fragment does not fit in a frame, has not the size of the first one or the message has too many fragments.
+    * 
+    * Function that puts the next fragment of the message in the transmit queue, waiting only while the queue is full. With frames with length the fragments carry a fragment header with an unknown number of fragments until the last one, so receive_message() can reassemble the message. The fragment must not be modified until the ticket is VLC_TX_DONE.
+    */
+    int VLC_forward_fragment(char * fragment, int fragment_size, bool last);
 
    /**
     * \fn int add_byte_to_buffer(char * frame_buffer, int * frame_index, int * frame_size, enum receiver_state * frame_state ,unsigned char data)
@@ -287,11 +998,27 @@ class VLC{
     * Function responsible for sampling the data received by VLC and captured by the analog port, for subsequent conversion and decoding of the data sent by the transmitter.
     */
     void sample_data();
+
+    /**
+    * \fn void process_sample(int value)
+    * \param Value read from the analog pin.
+    * 
+    * Function that compares a sample with the previous one to detect the edges of the received half bits.
+    */
+    void process_sample(int value);
+
+    /**
+    * \fn void capture_edge(unsigned int timestamp)
+    * \param Value of Timer1 captured at the edge.
+    * 
+    * Function called by the input capture interrupt, which converts the time since the previous edge into half bits of the received signal.
+    */
+    void capture_edge(unsigned int timestamp);
   
     /**
     * \fn int insert_character(char current_value, int value_period, int * time_from_last_sync, unsigned int * detected_character)
     * \param Value obtained from the comparison of the current and previous ADC reading.
-    * \param Period of value detected.
+    * \param Time for which the value was steady, in 1/VLC_PLL_SCALE of a sample.
     * \param Pointer to variable that define the times since the last synchronization of a received data.
     * \param Pointer associated with the detection of a new character for the treatment of this.
     * \return A 1 is returned when a new character is detected, a -1 is returned in case no character is detected.
@@ -309,14 +1036,205 @@ class VLC{
     * Function that checks the format of each received character, verifying the composition of this for the chaos that meets the characteristics insert it in the data buffer.
     */
     int is_a_character(int time_from_last_sync, unsigned int * detected_character);
+
+    /**
+    * \fn unsigned char sync_errors()
+    * \return Number of received chips that differ from the synchronization word, counted up to VLC_SYNC_MAX_ERRORS + 1.
+    * 
+    * Sliding correlator that compares the last chips received with the Manchester synchronization word, so it is found although a chip is corrupted.
+    */
+    unsigned char sync_errors();
   
   
   private:
 
+    /**
+    * \fn int queue_frame()
+    * \return Ticket of the queued frame.
+    * 
+    * Function that makes visible to the interrupt the frame written in the slot of the head of the transmit queue, starting the timer if it is stopped.
+    */
+    int queue_frame();
+
+    /**
+    * \fn bool is_continuation()
+    * \return True if the next queued frame has to be sent as a streamed fragment.
+    * 
+    * Function that determines if the frame that is being queued follows the previous frame of a stream.
+    */
+    bool is_continuation();
+
+    /**
+    * \fn int queue_message_frame(struct vlc_tx_message * message, char * data, int data_size)
+    * \param Message the frame belongs to, NULL for a whole frame.
+    * \param Data of the frame.
+    * \param Size of the data of the frame.
+    * \return The ticket of the queued frame is returned. -1 is returned if the frame can not be queued.
+    * 
+    * Function that queues the next fragment of a message with its fragment header, waiting for a free slot in the transmit queue.
+    */
+    int queue_message_frame(struct vlc_tx_message * message, char * data, int data_size);
+
+    /**
+    * \fn void end_message_stream()
+    * 
+    * Function that closes the stream of the message of send_VLC_begin(), stopping the timer if the transmit queue has already been emitted.
+    */
+    void end_message_stream();
+
+    /**
+    * \fn unsigned char frame_byte(struct vlc_frame_descriptor * descriptor, int index)
+    * \param Descriptor of the frame.
+    * \param Position of the byte in the frame.
+    * \return Byte of the frame in that position.
+    * 
+    * Function that reads a byte of the frame from the header, the data or the trailer of the descriptor.
+    */
+    unsigned char frame_byte(struct vlc_frame_descriptor * descriptor, int index);
+
+    /**
+    * \fn bool next_word()
+    * \return False if the queue is empty and the emission has been stopped.
+    * 
+    * Function that loads in manchester_data the next word to send: a word of the frame being emitted, a word of the next frame of the queue or an idle word.
+    */
+    bool next_word();
+
+    /**
+    * \fn void start_sampling()
+    * 
+    * Function that starts the sampling of the selected receiver front end.
+    */
+    void start_sampling();
+
+    /**
+    * \fn void stop_sampling()
+    * 
+    * Function that stops the sampling of the selected receiver front end.
+    */
+    void stop_sampling();
+
+    /**
+    * \fn void rx_push(int event, unsigned int character)
+    * \param Value returned by insert_character(). Nothing is saved if it is not positive.
+    * \param Half bits of the detected character.
+    * 
+    * Function called by the receive interrupt, the only producer of the ring, to save a detected character.
+    */
+    void rx_push(int event, unsigned int character);
+
+    /**
+    * \fn bool rx_pop(struct vlc_rx_symbol * symbol)
+    * \param Character taken from the ring.
+    * \return False if the ring is empty.
+    * 
+    * Function called by process_rx_symbols(), the only consumer of the ring, to take the oldest detected character.
+    */
+    bool rx_pop(struct vlc_rx_symbol * symbol);
+
+    /**
+    * \fn bool process_rx_symbols()
+    * \return True when a frame has been completed in frame_buffer. The remaining characters are left in the ring.
+    * 
+    * Function that decodes the characters of the ring and adds them to the frame being received, until the ring is empty or a frame is completed.
+    */
+    bool process_rx_symbols();
+
+    /**
+    * \fn int reassemble_fragment(char * buffer, int buffer_size, struct vlc_span * message)
+    * \param Pointer to the buffer where the fragments are placed.
+    * \param Size of the buffer.
+    * \param Part of the buffer that holds the message once it is complete, or part of frame_buffer for a whole frame received while a message is being reassembled.
+    * \return 1 if the message is complete, 0 if fragments are still missing and -1 if the frame was rejected.
+    * 
+    * Function that places the frame received in frame_buffer at the position given by its fragment header and marks it in the bitmap of the message. A whole frame received while a message is being reassembled is left in frame_buffer, which holds it until the next frame.
+    */
+    int reassemble_fragment(char * buffer, int buffer_size, struct vlc_span * message);
+
+    /**
+    * \fn int fragment_header_size()
+    * \return Size of the fragment header of the frame being queued.
+    * 
+    * Function that returns the bytes that the fragment header adds before the data, which are only sent in fragments of frames with length.
+    */
+    int fragment_header_size();
+
+    /**
+    * \fn int expected_fragments()
+    * \return Number of fragments of the message being reassembled or, if the number is not known yet, the fragments up to the highest index received and one more.
+    * 
+    * Function that obtains how many fragments the message being reassembled has, so the missing and lost fragments can be counted before the last fragment of a forwarded message arrives.
+    */
+    int expected_fragments();
+
+    /**
+    * \fn void start_emission()
+    * 
+    * Function that starts the selected emitter backend from a complete word with the lamp on.
+    */
+    void start_emission();
+
+    /**
+    * \fn void stop_emission()
+    * 
+    * Function that stops the selected emitter backend and leaves the lamp on.
+    */
+    void stop_emission();
+
+    /**
+    * \fn unsigned int frame_crc(const char * header, int header_size, const char * data, int size)
+    * \param Bytes of the header after the flag: the size and the fragment header, if any.
+    * \param Number of bytes of the header.
+    * \param Data of the frame.
+    * \param Number of bytes of data.
+    * \return CRC-16/CCITT-FALSE of the header and the data.
+    * 
+    * Function that computes the CRC sent at the end of the frames with the VLC_OPTION_CRC option.
+    */
+    unsigned int frame_crc(const char * header, int header_size, const char * data, int size);
+
     /****************************************************************************
     *                             Variables                                     *
     ****************************************************************************/
    
+    /** Selected frame format. */
+    enum vlc_frame_format frame_format = VLC_DEFAULT_FRAME_FORMAT ;
+
+    /** Size of the data of the frame with length being received. -1 if the frame being received ends with END_FLAG. */
+    int rx_payload_length = -1 ;
+
+    /** Selected options of the frames to send. */
+    unsigned char frame_options = 0 ;
+
+    /** Options of the frame being received. */
+    unsigned char rx_options = 0 ;
+
+    /** Variable that determines if the first Hamming code of a byte has been received. */
+    bool rx_fec_half = false ;
+
+    /** Most significant nibble of the byte being received with FEC. */
+    unsigned char rx_fec_byte = 0 ;
+
+    /** Counters of the errors detected in the received frames. */
+    struct vlc_error_stats error_stats = {0, 0, 0, 0} ;
+
+    #if VLC_ISR_STATS == 1
+    /** Measurements of the Timer3 interrupt. */
+    struct vlc_isr_stats isr_stats = {0xFFFF, 0, 0, 0, 0, {0}} ;
+
+    /** Shift from timer ticks to CPU cycles of the running timer. */
+    unsigned char isr_prescaler_shift = 0 ;
+    #endif
+
+    /** Selected line code. */
+    enum vlc_line_code line_code = VLC_DEFAULT_LINE_CODE ;
+
+    /** Number of half bits of each word in the selected line code. */
+    unsigned char word_length = WORD_LENGTH * 2 ;
+
+    /** Selected communication frequency. */
+    enum vlc_rate rate = VLC_DEFAULT_RATE ;
+
     /** Variable associated to the counter of the bits that represent each character to send. */
     unsigned char bit_counter = 0 ;
 
@@ -328,9 +1246,18 @@ class VLC{
 
     /** Data size of the frame to send via VLC. */
     int vlc_size_send;
+
+    /** Data of the message still to be queued. */
+    char * vlc_msg_send;
+
+    /** Size of the fragments of the message to send, zero if it is not fragmented. */
+    int vlc_fragment_send;
+
+    /** Ticket of the last frame of the message queued, -1 if none. */
+    int vlc_ticket = -1;
     
     /** Buffer where the frame will be saved. */
-    char frame_buffer [DATA_MAX+6] ;
+    char frame_buffer [FRAME_MAX] ;
 
     /** Index in frame. */
     int frame_index = -1; // index in frame
@@ -338,14 +1265,119 @@ class VLC{
     /** Size of the frame */
     int frame_size = -1  ;
 
-    /** Buffer where the message will be saved. */
-    char message_buffer [DATA_MAX] ;
+    /** Transmit queue where the frames wait until they are emitted. */
+    struct vlc_tx_slot tx_queue [VLC_TX_QUEUE_SLOTS] ;
+
+    /** Ticket of the next frame to queue. The slot used is tx_head % VLC_TX_QUEUE_SLOTS. */
+    volatile unsigned char tx_head = 0 ;
+
+    /** Ticket of the frame that is being emitted or the next one to emit. */
+    volatile unsigned char tx_tail = 0 ;
+
+    /** Variable that determines if the timer is running to emit the transmit queue. */
+    volatile bool tx_running = false ;
+
+    /** Variable that determines if a stream is open, so the timer is not stopped when the queue is empty. */
+    volatile bool tx_streaming = false ;
+
+    /** Variable that determines if the next word to send is the Hamming code of the least significant nibble. */
+    bool tx_fec_low = false ;
+
+    #if VLC_TX_BACKEND == VLC_TX_BACKEND_USART
+    /** Half bits that have not been loaded in the USART yet, the first one in the least significant bit. */
+    unsigned long int tx_pending = 0 ;
+
+    /** Number of half bits in tx_pending. */
+    unsigned char tx_pending_bits = 0 ;
+    #endif
+
+    /** Variable that determines if the next frame queued is the first one of the stream. */
+    bool tx_stream_first = false ;
+
+    /** Identifier of the last message sent in fragments. */
+    unsigned char tx_message_id = 0 ;
+
+    /** Message started by send_VLC_begin() and queued by send_VLC_poll(). */
+    struct vlc_tx_message vlc_message = {0, 0, 0, 0, false} ;
+
+    /** Message whose fragments are queued by VLC_forward_fragment(). */
+    struct vlc_tx_message tx_forward = {0, 0, 0, 0, false} ;
+
+    /** Message of the frame being queued, which is sent with its fragment header. It is NULL while any other frame is queued, so the frames queued between the fragments of a message are sent whole. */
+    struct vlc_tx_message * tx_message = NULL ;
+
+    /** Variable that determines if a streamed message is being sent, so the timer is not stopped when the queue is empty. */
+    volatile bool tx_message_streaming = false ;
+
+    /** Time (ms) that the message being reassembled waits for its next fragment, given by the last call to receive_message(). */
+    unsigned long reassembly_timeout = VLC_REASSEMBLY_TIMEOUT ;
+
+    /** Message being reassembled by receive_message(). */
+    struct vlc_reassembly reassembly = {false, 0, 0, 0, 0, 0, {0}, 0, 0} ;
+
+    /** Counters of the reassembly of the fragmented messages. */
+    struct vlc_reassembly_stats reassembly_stats = {0, 0, 0, 0, 0} ;
+
+    /** Function called at the end of the emission of each frame. */
+    void (*tx_callback)(int ticket) = NULL ;
 
     /** Variable that determines if a package is being received. */ 
     bool receiving;
+
+    /** Variable that determines if the timer and the ADC are running for the reception. */
+    bool rx_running = false;
+
+    #if VLC_RX_CONTINUOUS == 1
+    /** Variable that determines if the continuous reception is active, so the sampling is not stopped after each message. */
+    bool rx_continuous = false;
+
+    /** Queue where the frames of the continuous reception wait until they are read. */
+    struct vlc_rx_frame rx_frames [VLC_RX_FRAME_SLOTS] ;
+
+    /** Number of frames saved in the queue. The slot used is rx_frame_head % VLC_RX_FRAME_SLOTS. */
+    unsigned char rx_frame_head = 0 ;
+
+    /** Number of frames read from the queue. */
+    unsigned char rx_frame_tail = 0 ;
+
+    /** Frames discarded because the queue was full. */
+    unsigned int rx_frames_dropped = 0 ;
+    #endif
+
+    /** Characters lost in the ring that have already discarded a frame. */
+    unsigned int rx_overruns_seen = 0 ;
+
+    #if VLC_RX_FRONTEND == VLC_RX_FRONTEND_CAPTURE
+    /** Value of Timer1 captured at the previous edge. */
+    unsigned int last_capture = 0 ;
+
+    /** Timer1 ticks of each half bit at the selected frequency. */
+    unsigned int half_bit_ticks = 1 ;
+    #endif
+    
+    /** Ring of the characters detected by the receive interrupt. Only the interrupt writes rx_ring_head and only process_rx_symbols() writes rx_ring_tail. */
+    volatile unsigned int rx_ring_characters [VLC_RX_RING_SIZE] ;
+
+    /** Event of each character of the ring. */
+    volatile unsigned char rx_ring_events [VLC_RX_RING_SIZE] ;
+
+    /** Number of characters written in the ring. The slot used is rx_ring_head % VLC_RX_RING_SIZE. */
+    volatile unsigned char rx_ring_head = 0 ;
+
+    /** Number of characters read from the ring. */
+    volatile unsigned char rx_ring_tail = 0 ;
+
+    /** Characters lost because the ring was full. */
+    volatile unsigned int rx_overruns = 0 ;
+
+    /** Variable that determines if the receive interrupt is aligned to the characters. It is kept by the interrupt, apart from the state of the frame, which is processed later from the ring. */
+    volatile bool rx_synchronized = false ;
     
-    /** Variable that determines the reception of a new character. */ 
-    int new_character;
+    /** Length of a half bit estimated by the PLL, in 1/VLC_PLL_SCALE of a sample and multiplied by VLC_PLL_GAIN. It is kept by the receive interrupt. */
+    volatile unsigned int rx_chip_period = NUMBER_OF_SAMPLES * VLC_PLL_SCALE * VLC_PLL_GAIN ;
+
+    /** Phase error of the last edge, in 1/VLC_PLL_SCALE of a sample, that is added to the next time measured. */
+    volatile int rx_phase = 0 ;
     
     /** Variable used to save the received data. */ 
     unsigned char received_data;
@@ -12,21 +12,112 @@
 #include "LoRaWAN.h"
 #include "Conversions.h"
 #include "Frame.h"
+#include "Router.h"
+#include "Scheduler.h"
+#include "Priority.h"
 
 /****************************************************************************
 *                              Defines                                      *
 ****************************************************************************/
 #define DEBUG 1
 
+/** Time (ms) between the calls of the LoRaWAN task when there is nothing to receive. The polls are spaced by the LoRaWAN polling interval. */
+#define LORAWAN_TASK_PERIOD 100
+
+/** Time (ms) between the calls of the VLC task while a message is being sent. Once it is sent, the task sleeps until the next message wakes it. */
+#define VLC_TASK_PERIOD 10
+
+/** Time (ms) between the diagnostic messages. */
+#define DIAGNOSTICS_PERIOD 60000
+
+/** Defines whether each LoRaWAN frame directed to the VLC network is sent through the lamp as soon as it arrives (1), or the whole message is received before it is sent (0). The other networks always receive whole messages. */
+#define CUT_THROUGH 1
+
+/** Number of LoRaWAN frames that can be waiting or being emitted through VLC when the frames are forwarded as they arrive. The frames beyond the VLC transmit queue wait in the priority queues, where urgent frames go first. */
+#define FORWARD_WINDOW 4
+
+/** Ticket of a window buffer whose frame is waiting in the priority queues. */
+#define WINDOW_QUEUED -2
+
+/** Tag of the outgoing frames that are not kept in a window buffer. */
+#define NO_WINDOW 0xFF
+
+/** Memory (bytes) shared by the buffers of the LoRaWAN messages when the whole message is received before it is sent. */
+#define MESSAGE_MEMORY 2000
+
+/** Number of buffers of the LoRaWAN messages, so the next message is received while the lamp sends the previous one. With 1 buffer the longest message is twice as long, but the next message is only received once the previous one has been sent. */
+#define MESSAGE_BUFFERS 2
+
+/** Size (bytes) of each buffer of the LoRaWAN messages, which bounds the longest message. A frame is only polled while a whole LoRaWAN frame (LORAWAN_FRAME_MAX) fits after the data received, so the data before the last frame of a message can take up to MESSAGE_BUFFER_SIZE - LORAWAN_FRAME_MAX bytes. With hexadecimal frames at the default data rate (230 characters) the longest message is 920 characters with 2 buffers and 1840 with 1 buffer. */
+#define MESSAGE_BUFFER_SIZE (MESSAGE_MEMORY / MESSAGE_BUFFERS)
+
+/** Buffer of the messages that are not being sent through VLC. */
+#define NO_BUFFER 0xFF
+
+/** Defines whether the outgoing frames are scheduled by strict priority (PRIORITY_STRICT) or by weights (PRIORITY_WEIGHTED). */
+#define OUTGOING_POLICY PRIORITY_STRICT
+
 /****************************************************************************
 *                              Variables                                    *
 ****************************************************************************/
 
 /** Variable associated with the receiving port. */
-uint8_t* port_recived; 
+uint8_t port_received;
+
+#if CUT_THROUGH == 1
+/** Buffers where the LoRaWAN frames are received. Each one is read by the VLC emission of its frame, so it is only reused once the frame has been emitted. */
+char window [FORWARD_WINDOW][LORAWAN_FRAME_MAX];
+
+/** Ticket of the VLC frame that reads each buffer, WINDOW_QUEUED while the frame waits in the priority queues or -1 if it is free. */
+int window_ticket [FORWARD_WINDOW];
+
+/** Buffer of the frame being passed to the handlers. */
+uint8_t window_current = 0;
+
+/** Variable that determines if a message directed to the VLC network has started and its last frame has not arrived yet. */
+bool vlc_message_open = false;
+
+/** Variable that determines if a frame of the message directed to the VLC network could not be queued, so its next frames are dropped instead of taking its place. */
+bool vlc_message_dropped = false;
+
+/** Variable that determines if a fragment of the message being forwarded through VLC could not be queued, so the VLC task drops its next fragments. */
+bool vlc_forward_dropped = false;
+
+/** Buffer where the frames directed to the other networks are gathered, so their handlers receive the whole message. */
+char message [MESSAGE_BUFFER_SIZE];
+
+/** Size of the message gathered so far. */
+int message_size = 0;
+
+/** Size of the frames of the message gathered that are followed by more frames, 0 if it has only one frame. */
+int message_fragment_size = 0;
 
-/** Array where the data received through LoRaWAN is stored. */
-char data [2000];
+/** Variable that determines if the message gathered did not fit in its buffer, so it is not passed to the handlers. */
+bool message_overflow = false;
+
+static_assert(FORWARD_WINDOW < NO_WINDOW, "The window buffers are identified by the tag of the outgoing frames");
+#else
+/** Buffers where the LoRaWAN messages are received. */
+char data [MESSAGE_BUFFERS][MESSAGE_BUFFER_SIZE];
+
+/** Variable that determines if the message of each buffer is waiting or being sent through VLC. The data is read during the emission, so the buffer is not reused until it ends. */
+bool buffer_busy [MESSAGE_BUFFERS];
+
+/** Buffer where the current message is received. */
+uint8_t rx_buffer = 0;
+
+/** Buffer of the message being sent through VLC, NO_BUFFER if none. */
+uint8_t vlc_buffer = NO_BUFFER;
+
+/** Ticket of the control frame of each buffer that is sent between the fragments of a message, -1 if none. The buffer is freed once its frame has been emitted. */
+int buffer_ticket [MESSAGE_BUFFERS];
+
+static_assert(MESSAGE_BUFFERS < NO_BUFFER, "The message buffers are identified by the tag of the outgoing frames");
+static_assert(MESSAGE_BUFFER_SIZE >= LORAWAN_FRAME_MAX, "A message buffer has to hold a LoRaWAN frame");
+#endif
+
+/** Identifier of the VLC task. */
+int vlc_task_id;
 
 /** Size of the received data. */
 int data_size_received;
@@ -34,199 +125,421 @@ int data_size_received;
 /** Size of the framgment that compose the data. */
 int fragment_size;
 
+/** Identifier of the LoRaWAN task. */
+int lorawan_task_id;
+
+/** Identifier of the diagnostics task, the last one added. */
+int diagnostics_task_id;
+
 /****************************************************************************
-*                              Main Program                                 *
+*                              Handlers                                     *
 ****************************************************************************/
 
-void setup() {
-  // Serial bus initialize.
-  USB.ON();
-  // Transmission pin is defined as output.
-  PIN_OUT();
-  // The lamp is turned on.
-  PIN_ON();
-  // Initialization of LoRaWAN
-  lorawan_object.init_lorawan();
-  // Initialization of VLC
-  vlc_object.init_VLC_emitter();
+#if DEBUG == 1
+/** Names of the frame purposes, indexed by FramePurpouse. */
+const char* const PURPOSE_NAMES[] = {"", "Board Sensor", "External Sensor", "MAC Request", "MAC Answer", "Actuator", "Zigbee data", "VLC data", "RTC"};
+#endif
 
+/**
+* Handler of the purposes that only have to be identified.
+*/
+void print_purpose(uint8_t network, uint8_t purpose, char* data, int size, int fragment_size){
+  #if DEBUG == 1
+    USB.println(PURPOSE_NAMES[purpose]);
+  #endif
 }
 
+/**
+* Default handler of the VLC and Zigbee networks, which shows the data received.
+*/
+void print_data(uint8_t network, uint8_t purpose, char* data, int size, int fragment_size){
+  #if DEBUG == 1
+    USB.println(F("Data has been received "));
+    USB.print(F("Data Size: "));USB.println(size);
+    USB.print(F("Data Received: "));
+    for(int i=0; i<size; i++){
+      USB.print(data[i]);
+    }
+    USB.println();
+    USB.print(F("Fragment Size: "));USB.println(fragment_size);
+  #endif
+}
 
-void loop(){
+#if CUT_THROUGH == 1
+/**
+* Function that puts a frame kept in the current window buffer in the VLC priority queues, and returns false if they are full.
+*/
+bool submit_vlc(struct outgoing_frame* frame){
+  // The buffer of the frame is kept until the frame has been emitted.
+  if(vlc_queues.submit(frame)){
+    window_ticket[window_current] = WINDOW_QUEUED;
+    scheduler_object.wake_task(vlc_task_id);
+    return true;
+  }
+  #if DEBUG == 1
+    USB.println(F("VLC queue full"));
+  #endif
+  return false;
+}
+
+/**
+* Handler of the data directed to the VLC network, which forwards each LoRaWAN frame through the lamp as it arrives.
+*/
+void send_vlc_data(uint8_t network, uint8_t purpose, char* data, int size, int fragment_size){
+  // The frames of a message are VLC fragments, sent before the size of the message is known. The last one has no fragment size.
+  struct outgoing_frame frame = {data, size, purpose, true, !vlc_message_open, fragment_size == 0, window_current, 0};
+  vlc_message_open = (fragment_size != 0);
+
+  // Once a frame is lost, the rest of its message is dropped, so the receiver never places a frame in the position of another one.
+  if(frame.first){
+    vlc_message_dropped = false;
+  }
+  if(!vlc_message_dropped && !submit_vlc(&frame)){
+    vlc_message_dropped = true;
+  }
+}
+
+/**
+* Handler of the control frames directed to the VLC network, which are sent through the lamp before the waiting VLC data.
+*/
+void send_vlc_control(uint8_t network, uint8_t purpose, char* data, int size, int fragment_size){
+  struct outgoing_frame frame = {data, size, purpose, false, false, false, window_current, 0};
+  submit_vlc(&frame);
+}
+#else
+/**
+* Function that puts a message kept in the current message buffer in the VLC priority queues.
+*/
+void submit_vlc(struct outgoing_frame* frame){
+  // The buffer of the message is kept until the VLC task has sent it.
+  if(vlc_queues.submit(frame)){
+    buffer_busy[rx_buffer] = true;
+    scheduler_object.wake_task(vlc_task_id);
+  }else{
+    #if DEBUG == 1
+      USB.println(F("VLC queue full"));
+    #endif
+  }
+}
+
+/**
+* Handler of the data directed to the VLC network, which is sent through the lamp.
+*/
+void send_vlc_data(uint8_t network, uint8_t purpose, char* data, int size, int fragment_size){
+  #if DEBUG == 1
+    USB.print(F("Data Received: "));
+    for(int i=0; i<size; i++){
+      USB.print(data[i]);
+    }
+    USB.println("VLC data");
+  #endif
+  struct outgoing_frame frame = {data, size, purpose, false, false, false, rx_buffer, fragment_size};
+  submit_vlc(&frame);
+}
+
+/**
+* Handler of the control frames directed to the VLC network, which are sent through the lamp before the waiting VLC data, between the fragments of the message being sent.
+*/
+void send_vlc_control(uint8_t network, uint8_t purpose, char* data, int size, int fragment_size){
+  struct outgoing_frame frame = {data, size, purpose, false, false, false, rx_buffer, 0};
+  submit_vlc(&frame);
+}
+#endif
+
+/****************************************************************************
+*                              Tasks                                        *
+****************************************************************************/
+
+#if CUT_THROUGH == 1
+/**
+* Function that returns a window buffer whose frame has already been emitted, or -1 if every buffer is in use.
+*/
+int free_window(){
+  for(int i = 0; i < FORWARD_WINDOW; i++){
+    if(window_ticket[i] >= 0 && vlc_object.VLC_send_status(window_ticket[i]) == VLC_TX_DONE){
+      window_ticket[i] = -1;
+    }
+    if(window_ticket[i] == -1){
+      return i;
+    }
+  }
+  return -1;
+}
+
+/**
+* Function that appends a frame directed to the networks other than VLC to the message being gathered, and passes the message to their handlers once its last frame arrives.
+*/
+void gather_message(struct frame_header* header, char* frame, int size){
+  if(message_size + size > MESSAGE_BUFFER_SIZE){
+    message_overflow = true;
+  }else{
+    memcpy(message + message_size, frame, size);
+    message_size += size;
+    if(header->more_fragments){
+      message_fragment_size = size;
+    }
+  }
 
-  // It checks if available data sent by the LoRaWAN gateway.
-  if(lorawan_object.receive_lorawan(port_recived, data, &data_size_received, &fragment_size)){
+  if(!header->more_fragments){
+    if(!message_overflow){
+      router_object.route(header, message, message_size, message_fragment_size);
+    }else{
+      #if DEBUG == 1
+        USB.println(F("Message longer than the buffer"));
+      #endif
+    }
+    message_size = 0;
+    message_fragment_size = 0;
+    message_overflow = false;
+  }
+}
 
-    // The identifier of the destination network encapsulated in the received frame is obtained.
-    uint8_t destination_network = conversions_object.char_to_uint8t(data[0],data[1]);
+/**
+* Task that receives the frames from the LoRaWAN gateway, one poll per call. Each frame directed to the VLC network is passed to its handlers as soon as it arrives, and the other networks receive the whole message.
+*/
+unsigned long lorawan_task(){
+  // The window is full while no frame has been emitted through VLC.
+  int window_free = free_window();
+  if(window_free < 0){
+    return VLC_TASK_PERIOD;
+  }
+  window_current = window_free;
 
-    // The network to which the data is directed is checked and the corresponding action is performed.
-    if(destination_network & LORAWAN_NETWORK){  // LoRaWAN network.
+  enum lorawan_rx_state state = lorawan_object.receive_fragment_step(&port_received, window[window_current], &data_size_received);
+  if(data_size_received > 0){
+    // The header of the received frame, decoded on reception, is obtained.
+    struct frame_header header = lorawan_object.get_frame_header();
+
+    // The frame is passed to the handler of its purpose in the VLC network. The size of the fragments is zero in the last frame.
+    struct frame_header vlc_header = header;
+    vlc_header.network &= VLC_NETWORK;
+    if(vlc_header.network){
+      fragment_size = header.more_fragments ? data_size_received : 0;
+      router_object.route(&vlc_header, window[window_current], data_size_received, fragment_size);
+    }
+
+    // The frame is copied for the other networks, so its window buffer is only kept for the VLC emission.
+    header.network &= ~VLC_NETWORK;
+    if(header.network){
+      gather_message(&header, window[window_current], data_size_received);
+    }
+  }
+
+  switch(state){
+    case LORAWAN_RX_RECEIVING: // The next fragment is polled in the next pass, after the other tasks.
+    case LORAWAN_RX_DONE:
+      return 0;
+    case LORAWAN_RX_FAILED:
+      // The VLC receiver abandons the message when its next fragment does not arrive, and the next frame starts a new one. The message gathered for the other networks is discarded.
+      vlc_message_open = false;
+      message_size = 0;
+      message_fragment_size = 0;
+      message_overflow = false;
       #if DEBUG == 1
-        USB.println("LoRaWAN Network");
+        USB.println(F("Fragmented data not completed"));
       #endif
-      switch(conversions_object.char_to_uint8t(data[2],data[3]) & 0x7F){ // The purpose of the frame is identified.
-        case BOARD_SENSOR: // Sending the associated data to a board sensors.
-          #if DEBUG == 1
-            USB.println("Board Sensor");
-          #endif
-          break;
-        case EXTERNAL_SENSOR: // Sending the associated data to a external sensors.
-          #if DEBUG == 1
-            USB.println("External Sensor");
-          #endif
-          break;
-        case MAC_REQUEST: // MAC request made by a Zigbee node.
-          #if DEBUG == 1
-            USB.println("MAC Request");
-          #endif
-          break;
-        case MAC_ANSWER: // Answer to the MAC request made by a Zigbee node.
-          #if DEBUG == 1
-            USB.println("MAC Answer");
-          #endif
-          break;  
-        case ACTUATOR: // Data associated with the interaction with actuators.
-          #if DEBUG == 1
-            USB.println("Actuator");
-          #endif
-          break;  
-        case ZIGBEE_DATA: // Data directed to a Zigbee node.
-          #if DEBUG == 1
-            USB.println("Zigbee data");
-          #endif
-          break; 
-        case VLC_DATA: // Data directed to a VLC network.
-          #if DEBUG == 1
-            USB.println("VLC data");
-          #endif
-          break;  
-        default:
-          break;  
+      return 0;
+    default:
+      return LORAWAN_TASK_PERIOD;
+  }
+}
+
+/**
+* Task that takes the frames from the VLC priority queues as the transmit queue frees, so an urgent frame only waits for the frames already being emitted.
+*/
+unsigned long vlc_task(){
+  struct outgoing_frame frame;
+  int ticket;
+
+  while(vlc_object.VLC_tx_free_slots() > 0 && vlc_queues.next(&frame)){
+    if(frame.fragment){
+      if(frame.first){
+        vlc_object.VLC_forward_begin();
+        vlc_forward_dropped = false;
       }
+      // After a fragment that could not be queued the message is abandoned: its next fragments would take the index of the lost one.
+      ticket = vlc_forward_dropped ? -1 : vlc_object.VLC_forward_fragment(frame.data, frame.size, frame.last);
+      vlc_forward_dropped = (ticket < 0);
+    }else{
+      ticket = vlc_object.VLC_send_async(frame.data, frame.size);
+    }
+    // The buffer of the frame is freed once the ticket is done, or now if the frame could not be queued.
+    if(frame.tag != NO_WINDOW){
+      window_ticket[frame.tag] = ticket;
+    }
+  }
+  return (vlc_queues.pending() > 0) ? VLC_TASK_PERIOD : SCHEDULER_SLEEP;
+}
+#else
+/**
+* Function that returns a message buffer that is not waiting or being sent through VLC, or -1 if every buffer is in use.
+*/
+int free_buffer(){
+  for(int i = 0; i < MESSAGE_BUFFERS; i++){
+    if(buffer_ticket[i] >= 0 && vlc_object.VLC_send_status(buffer_ticket[i]) == VLC_TX_DONE){
+      buffer_ticket[i] = -1;
+      buffer_busy[i] = false;
+    }
+    if(!buffer_busy[i]){
+      return i;
+    }
+  }
+  return -1;
+}
+
+/**
+* Task that receives the messages from the LoRaWAN gateway, one poll per call, and passes them to their handlers.
+*/
+unsigned long lorawan_task(){
+  // The next message is received in a free buffer while the lamp sends the previous ones. The buffer of a message being received is never busy.
+  if(buffer_busy[rx_buffer]){
+    int buffer_free = free_buffer();
+    if(buffer_free < 0){
+      return LORAWAN_TASK_PERIOD;
     }
+    rx_buffer = buffer_free;
+  }
+
+  switch(lorawan_object.receive_lorawan_step(&port_received, data[rx_buffer], &data_size_received, &fragment_size, MESSAGE_BUFFER_SIZE)){
+    case LORAWAN_RX_RECEIVING: // The next fragment is polled in the next pass, after the other tasks.
+      return 0;
+    case LORAWAN_RX_DONE:{
+      // The header of the received frame, decoded on reception, is obtained.
+      struct frame_header header = lorawan_object.get_frame_header();
 
-    if(destination_network & VLC_NETWORK){  // VLC network.
       #if DEBUG == 1
+        if(header.network & LORAWAN_NETWORK){
+          USB.println("LoRaWAN Network");
+        }
+        if(header.network & VLC_NETWORK){
           USB.println("VLC Network");
+        }
+        if(header.network & ZIGBEE_NETWORK){
+          USB.println("Zigbee Network");
+        }
       #endif
-     
-      switch(conversions_object.char_to_uint8t(data[2],data[3]) & 0x7F){ // The purpose of the frame is identified.
-        case BOARD_SENSOR: // Sending the associated data to a board sensors.
-          #if DEBUG == 1
-            USB.println("Board Sensor");
-          #endif
-          break;
-        case EXTERNAL_SENSOR: // Sending the associated data to a external sensors.
-          #if DEBUG == 1
-            USB.println("External Sensor");
-          #endif
-          break;
-        case MAC_REQUEST: // MAC request made by a Zigbee node.
-          #if DEBUG == 1
-            USB.println("MAC Request");
-          #endif
-          break;
-        case MAC_ANSWER: // Answer to the MAC request made by a Zigbee node.
-          #if DEBUG == 1
-            USB.println("MAC Answer");
-          #endif
-          break;  
-        case ACTUATOR: // Data associated with the interaction with actuators.
-          #if DEBUG == 1
-            USB.println("Actuator");
-          #endif
-          break;  
-        case ZIGBEE_DATA: // Data directed to a Zigbee node.
-          #if DEBUG == 1
-            USB.println("Zigbee data");
-          #endif
-          break; 
-        case VLC_DATA: // Data directed to a VLC network.
-          #if DEBUG == 1
-            USB.print(F("Data Received: "));
-            for(int i=0; i<data_size_received; i++){
-              USB.print(data[i]);
-            }
-            USB.println("VLC data");
-          #endif
-          vlc_object.send_VLC(data, data_size_received, fragment_size);
-          break;  
-        default:
-          #if DEBUG == 1
-            USB.println(F("Data has been received "));
-            USB.print(F("Data Size: "));USB.println(data_size_received);
-            USB.print(F("Data Received: "));
-            for(int i=0; i<data_size_received; i++){
-              USB.print(data[i]);
-            }
-            USB.println();
-            USB.print(F("Fragment Size: "));USB.println(fragment_size);
-          #endif
-          break;        
-      }
-    }
 
-    if(destination_network & ZIGBEE_NETWORK){  // Zigbee network.
+      // The frame is passed to the handler of its purpose in each destination network.
+      router_object.route(&header, data[rx_buffer], data_size_received, fragment_size);
+      return 0;
+    }
+    case LORAWAN_RX_FAILED:
       #if DEBUG == 1
-        USB.println("Zigbee Network");
+        USB.println(F("Fragmented data not completed"));
       #endif
-      switch(conversions_object.char_to_uint8t(data[2],data[3]) & 0x7F){ // The purpose of the frame is identified.
-        case BOARD_SENSOR: // Sending the associated data to a board sensors.
-          #if DEBUG == 1
-            USB.println("Board Sensor");
-          #endif
-          break;
-        case EXTERNAL_SENSOR: // Sending the associated data to a external sensors.
-          #if DEBUG == 1
-            USB.println("External Sensor");
-          #endif
-          break;
-        case MAC_REQUEST: // MAC request made by a Zigbee node.
-          #if DEBUG == 1
-            USB.println("MAC Request");
-          #endif
-          break;
-        case MAC_ANSWER: // Answer to the MAC request made by a Zigbee node.
-          #if DEBUG == 1
-            USB.println("MAC Answer");
-          #endif
-          break;  
-        case ACTUATOR: // Data associated with the interaction with actuators.
-          #if DEBUG == 1
-            USB.println("Actuator");
-          #endif
-          break;  
-        case ZIGBEE_DATA: // Data directed to a Zigbee node.
-          #if DEBUG == 1
-            USB.println("Zigbee data");
-          #endif
-          break; 
-        case VLC_DATA: // Data directed to a VLC network.
-          #if DEBUG == 1
-            USB.println("VLC data");
-          #endif
-          break;  
-        default:
-          #if DEBUG == 1
-            USB.println(F("Data has been received "));
-            USB.print(F("Data Size: "));USB.println(data_size_received);
-            USB.print(F("Data Received: "));
-            for(int i=0; i<data_size_received; i++){
-              USB.print(data[i]);
-            }
-            USB.println();
-            USB.print(F("Fragment Size: "));USB.println(fragment_size);
-          #endif
-          break;      
-      }
+      return 0;
+    default:
+      return LORAWAN_TASK_PERIOD;
+  }
+}
+#endif
+
+#if CUT_THROUGH == 0
+/**
+* Task that sends through VLC the messages waiting in the priority queues, one after another, and queues the fragments of each one while the lamp emits the previous ones.
+*/
+unsigned long vlc_task(){
+  struct outgoing_frame frame;
+
+  // The control frames do not wait for the message being sent: they are queued at the next frame boundary, between its fragments.
+  while(vlc_buffer != NO_BUFFER && vlc_object.VLC_tx_free_slots() > 0 && vlc_queues.next(&frame, PRIORITY_CONTROL)){
+    buffer_ticket[frame.tag] = vlc_object.VLC_send_async(frame.data, frame.size);
+    if(buffer_ticket[frame.tag] < 0){
+      buffer_busy[frame.tag] = false;
     }
-  }else{
-    #if DEBUG == 1
-      USB.println(F("No data received"));
-    #endif
   }
-  
-  
+
+  // The next message is started once the previous one has been emitted.
+  if(vlc_buffer == NO_BUFFER && vlc_queues.next(&frame)){
+    if(vlc_object.send_VLC_begin(frame.data, frame.size, frame.fragment_size) == 0){
+      vlc_buffer = frame.tag;
+    }else{
+      buffer_busy[frame.tag] = false;
+    }
+  }
+
+  if(vlc_buffer != NO_BUFFER && !vlc_object.send_VLC_poll()){
+    // The buffer is free again for the next LoRaWAN message.
+    buffer_busy[vlc_buffer] = false;
+    vlc_buffer = NO_BUFFER;
+    scheduler_object.wake_task(lorawan_task_id);
+  }
+  if(vlc_buffer != NO_BUFFER){
+    return VLC_TASK_PERIOD;
+  }
+  return (vlc_queues.pending() > 0) ? 0 : SCHEDULER_SLEEP;
+}
+#endif
+
+/**
+* Task that shows the statistics of the LoRaWAN polling and of the tasks.
+*/
+unsigned long diagnostics_task(){
+  #if DEBUG == 1
+    struct lorawan_poll_stats poll_stats = lorawan_object.get_poll_stats();
+    USB.print(F("Polls: "));USB.print(poll_stats.polls);
+    USB.print(F(" Hits: "));USB.println(poll_stats.hits);
+    for(int task = 0; task <= diagnostics_task_id; task++){
+      struct scheduler_task_stats task_stats = scheduler_object.get_task_stats(task);
+      USB.print(F("Task "));USB.print(task);
+      USB.print(F(" - Runs: "));USB.print(task_stats.runs);
+      USB.print(F(" Busy (ms): "));USB.print(task_stats.busy_time);
+      USB.print(F(" Max (ms): "));USB.println(task_stats.max_time);
+    }
+    for(int priority = 0; priority < PRIORITY_LEVELS; priority++){
+      struct priority_stats queue_stats = vlc_queues.get_stats(priority);
+      USB.print(F("VLC priority "));USB.print(priority);
+      USB.print(F(" - Sent: "));USB.print(queue_stats.sent);
+      USB.print(F(" Dropped: "));USB.print(queue_stats.dropped);
+      USB.print(F(" Max wait (ms): "));USB.println(queue_stats.max_wait);
+    }
+  #endif
+  return DIAGNOSTICS_PERIOD;
+}
+
+/****************************************************************************
+*                              Main Program                                 *
+****************************************************************************/
+
+void setup() {
+  // Serial bus initialize.
+  USB.ON();
+  // Transmission pin is defined as output.
+  PIN_OUT();
+  // The lamp is turned on.
+  PIN_ON();
+  // Initialization of LoRaWAN
+  lorawan_object.init_lorawan();
+  // Initialization of VLC
+  vlc_object.init_VLC_emitter();
+  // Registration of the handlers of each network and purpose.
+  for(uint8_t purpose = BOARD_SENSOR; purpose <= VLC_DATA; purpose++){
+    router_object.register_handler(LORAWAN_NETWORK | VLC_NETWORK | ZIGBEE_NETWORK, purpose, print_purpose);
+  }
+  router_object.register_handler(VLC_NETWORK | ZIGBEE_NETWORK, ROUTER_DEFAULT_PURPOSE, print_data);
+  router_object.register_handler(VLC_NETWORK, VLC_DATA, send_vlc_data);
+  router_object.register_handler(VLC_NETWORK, ACTUATOR, send_vlc_control);
+  router_object.register_handler(VLC_NETWORK, RTC_TIME, send_vlc_control);
+  // Scheduling of the outgoing frames.
+  vlc_queues.set_policy(OUTGOING_POLICY);
+  // Tasks of the main loop.
+  lorawan_task_id = scheduler_object.add_task(lorawan_task);
+  #if CUT_THROUGH == 1
+    for(int i = 0; i < FORWARD_WINDOW; i++){
+      window_ticket[i] = -1;
+    }
+  #else
+    for(int i = 0; i < MESSAGE_BUFFERS; i++){
+      buffer_busy[i] = false;
+      buffer_ticket[i] = -1;
+    }
+  #endif
+  vlc_task_id = scheduler_object.add_task(vlc_task);
+  diagnostics_task_id = scheduler_object.add_task(diagnostics_task);
+}
+
+
+void loop(){
+  // The tasks interleave: each one performs a step of its work and yields.
+  scheduler_object.run();
 }